@@ -2,18 +2,30 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 // this must come after stdio.h.
 #include <readline/readline.h>
 
@@ -69,8 +81,6 @@ void reset_fd(void) {
   HANDLE_CASE(dup(5) != 0);
 }
 
-enum { BUFFER_MAX = 4 * 1024 * 1024 };
-enum { ENTRIES_MAX = 32768 };
 enum { OUTBUF_MAX = 131072 };
 
 int term_width, term_height;
@@ -81,7 +91,7 @@ void get_term_dimensions(void) {
   ioctl(0, TIOCGWINSZ, &winsize);
   term_width = winsize.ws_col;
   term_height = winsize.ws_row;
-  HANDLE_CASE(term_width * term_height >= OUTBUF_MAX);
+  HANDLE_CASE((term_width + 16) * term_height >= OUTBUF_MAX);
 }
 
 int tolower_table[256];
@@ -95,288 +105,3596 @@ void tolower_table_calc(void) {
   }
 }
 
-int buffer_sz;
-char buffer[BUFFER_MAX];
+// lower_cmp compares two names like strcmp compares their lowercase forms.
+int lower_cmp(const char *a, int alen, const char *b, int blen) {
+  int len = alen < blen ? alen : blen;
+  for (int i = 0; i < len; ++i) {
+    int d = tolower_table[(unsigned char)a[i]] -
+            tolower_table[(unsigned char)b[i]];
+    if (d != 0) return d;
+  }
+  return alen - blen;
+}
 
-char *bufdup(const char *buf, int sz) {
-  HANDLE_CASE(buffer_sz + sz >= BUFFER_MAX);
-  char *p = buffer + buffer_sz;
-  memcpy(p, buf, sz);
-  buffer_sz += sz;
-  return p;
+int curpath_sz;
+char curpath[PATH_MAX + 1];
+
+double now(void) {
+  struct timespec ts;
+  HANDLE_CASE(clock_gettime(CLOCK_MONOTONIC, &ts) != 0);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-int entries_sz;
-struct entry {
-  int len;
-  const char *name;
-  const char *name_lower;
-} entries[ENTRIES_MAX];
+bool timespec_after(struct timespec a, struct timespec b) {
+  return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+// The crawler walks the hierarchy on multiple threads. Each thread has a deque
+// of directories to scan. It takes the newest directory from its own deque
+// and steals the oldest one from the others when its own is empty. A
+// subdirectory is opened relative to its parent's fd while the number of open
+// fds is within budget, otherwise it is opened by its path when it is taken.
+// Each thread collects the paths into its own arena, the per-thread lists are
+// merged at the end.
+enum { CRAWL_THREADS_MAX = 64 };
+enum { DENTS_BUF_SIZE = 256 * 1024 };
+enum { ARENA_CHUNK = 1024 * 1024 };
+enum { CRAWL_BATCH = 4096 };
+#define CRAWL_PUBLISH_INTERVAL 0.05
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-void entry_add(const char *buf, int len) {
-  HANDLE_CASE(entries_sz >= ENTRIES_MAX);
-  struct entry *e = &entries[entries_sz++];
-  e->len = len;
-  e->name = buf;
-  char *lowbuf = bufdup(buf, len + 1);
-  for (char *p = lowbuf; *p != 0; ++p) *p = tolower_table[(unsigned char)*p];
-  e->name_lower = lowbuf;
+// The arena's memory is never moved so the paths in it stay valid until the
+// arena is freed.
+struct arena {
+  char *chunk;
+  int used;
+  int cap;
+  char **chunks;
+  int chunks_sz;
+};
+
+char *arena_alloc(struct arena *a, int sz) {
+  if (a->used + sz > a->cap) {
+    a->cap = sz > ARENA_CHUNK ? sz : ARENA_CHUNK;
+    HANDLE_CASE((a->chunk = malloc(a->cap)) == NULL);
+    a->used = 0;
+    a->chunks = realloc(a->chunks, (a->chunks_sz + 1) * sizeof(a->chunks[0]));
+    HANDLE_CASE(a->chunks == NULL);
+    a->chunks[a->chunks_sz++] = a->chunk;
+  }
+  char *p = a->chunk + a->used;
+  a->used += sz;
+  return p;
 }
 
-int entry_cmp(const void *a, const void *b) {
-  const struct entry *x = a;
-  const struct entry *y = b;
-  return strcmp(x->name_lower, y->name_lower);
+void arena_free(struct arena *a) {
+  for (int i = 0; i < a->chunks_sz; ++i) free(a->chunks[i]);
+  free(a->chunks);
+  memset(a, 0, sizeof(*a));
 }
 
-int curpath_sz;
-char curpath[PATH_MAX + 1];
+// arena_alloc8 returns 8 byte aligned memory.
+void *arena_alloc8(struct arena *a, int sz) {
+  uintptr_t p = (uintptr_t)arena_alloc(a, sz + 7);
+  return (void *)((p + 7) & ~(uintptr_t)7);
+}
 
-void read_subtree(DIR *dirp) {
-  struct dirent *ent;
-  while ((ent = readdir(dirp)) != NULL) {
-    if (ent->d_name[0] == '.') continue;
-    int len = strlen(ent->d_name);
-    HANDLE_CASE(curpath_sz + len + 1 >= PATH_MAX);
+// The .gitignore and .ignore files of a directory are parsed into one ignore
+// node, the rules of .ignore come later so they win. The nodes point to the
+// parent directory's node so a directory's rules apply to its whole subtree.
+// A pattern with a slash in it (other than a trailing one) is matched against
+// the path relative to the node's directory, one without against the name.
+// The last matching rule of the deepest node decides. Ignored directories are
+// not descended into so their contents can't be re-included, like in git.
+struct ignore_rule {
+  const char *pat;
+  int len;
+  bool negate;
+  bool dir_only;
+  bool anchored;
+  bool literal;
+};
 
-    int oldsz = curpath_sz;
-    memcpy(curpath + curpath_sz, ent->d_name, len);
-    curpath_sz += len;
-    curpath[curpath_sz] = 0;
+struct ignore {
+  const struct ignore *parent;
+  int dir_len;
+  struct ignore_rule *rules;
+  int rules_sz;
+};
 
-    if (ent->d_type == DT_UNKNOWN) {
-      struct stat s;
-      HANDLE_CASE(stat(curpath, &s) == -1);
-      if (S_ISDIR(s.st_mode)) ent->d_type = DT_DIR;
-    }
+bool use_ignore = true;
 
-    if (ent->d_type == DT_DIR) {
-      DIR *subdirp = opendir(curpath);
-      if (subdirp == NULL) {
-        HANDLE_CASE(errno != EACCES);
-      } else {
-        HANDLE_CASE(subdirp == NULL);
-        curpath[curpath_sz++] = '/';
-        read_subtree(subdirp);
-        HANDLE_CASE(closedir(subdirp) == -1);
+// glob_match matches s against the gitignore glob p. * and ? don't match a
+// slash, **/ matches zero or more directories and a trailing ** matches
+// everything.
+bool glob_match(const char *p, int plen, const char *s, int slen) {
+  int pi = 0, si = 0;
+  while (pi < plen) {
+    char c = p[pi];
+    if (c == '*') {
+      bool any = pi + 1 < plen && p[pi + 1] == '*';
+      int rest = pi + (any ? 2 : 1);
+      if (any && rest == plen) return true;
+      if (any && p[rest] == '/') {
+        rest++;
+        for (int k = si; k <= slen; ++k) {
+          if ((k == si || s[k - 1] == '/') &&
+              glob_match(p + rest, plen - rest, s + k, slen - k)) {
+            return true;
+          }
+        }
+        return false;
+      }
+      for (int k = si; k <= slen; ++k) {
+        if (glob_match(p + rest, plen - rest, s + k, slen - k)) return true;
+        if (!any && k < slen && s[k] == '/') break;
+      }
+      return false;
+    }
+    if (si == slen) return false;
+    if (c == '?') {
+      if (s[si] == '/') return false;
+    } else if (c == '[') {
+      int i = pi + 1;
+      bool negate = i < plen && (p[i] == '!' || p[i] == '^');
+      if (negate) i++;
+      int end = i < plen && p[i] == ']' ? i + 1 : i;
+      while (end < plen && p[end] != ']') end++;
+      if (end < plen) {
+        unsigned char ch = s[si];
+        bool in = false;
+        for (; i < end; ++i) {
+          if (i + 2 < end && p[i + 1] == '-') {
+            in |= (unsigned char)p[i] <= ch && ch <= (unsigned char)p[i + 2];
+            i += 2;
+          } else {
+            in |= (unsigned char)p[i] == ch;
+          }
+        }
+        if (in == negate || ch == '/') return false;
+        pi = end + 1;
+        si++;
+        continue;
       }
+      if (s[si] != '[') return false;
     } else {
-      entry_add(bufdup(curpath, curpath_sz + 1), curpath_sz);
+      if (c == '\\' && pi + 1 < plen) c = p[++pi];
+      if (s[si] != c) return false;
+    }
+    pi++;
+    si++;
+  }
+  return si == slen;
+}
+
+// ignored tells whether the path is ignored. The path has no trailing slash,
+// its name starts at name_off.
+bool ignored(const struct ignore *ig, const char *path, int len, int name_off,
+             bool is_dir) {
+  for (; ig != NULL; ig = ig->parent) {
+    for (int i = ig->rules_sz - 1; i >= 0; --i) {
+      const struct ignore_rule *r = &ig->rules[i];
+      if (r->dir_only && !is_dir) continue;
+      int off = r->anchored ? ig->dir_len : name_off;
+      const char *s = path + off;
+      bool match = r->literal
+                       ? r->len == len - off && !memcmp(s, r->pat, r->len)
+                       : glob_match(r->pat, r->len, s, len - off);
+      if (match) return !r->negate;
+    }
+  }
+  return false;
+}
+
+// ignore_parse adds the rules in data to ig.
+void ignore_parse(struct arena *a, struct ignore *ig, char *data, int sz) {
+  int lines = 1;
+  for (int i = 0; i < sz; ++i) lines += data[i] == '\n';
+  struct ignore_rule *rules =
+      arena_alloc8(a, (ig->rules_sz + lines) * sizeof(rules[0]));
+  if (ig->rules_sz > 0) {
+    memcpy(rules, ig->rules, ig->rules_sz * sizeof(rules[0]));
+  }
+  ig->rules = rules;
+  for (char *line = data, *end; line < data + sz; line = end + 1) {
+    end = memchr(line, '\n', data + sz - line);
+    if (end == NULL) end = data + sz;
+    int len = end - line;
+    if (len > 0 && line[len - 1] == '\r') len--;
+    while (len > 0 && line[len - 1] == ' ' &&
+           (len < 2 || line[len - 2] != '\\')) {
+      len--;
+    }
+    if (len == 0 || line[0] == '#') continue;
+    struct ignore_rule r = {line, len, false, false, false, true};
+    if (r.pat[0] == '!') {
+      r.negate = true;
+      r.pat++;
+      r.len--;
+    }
+    if (r.len > 0 && r.pat[r.len - 1] == '/') {
+      r.dir_only = true;
+      r.len--;
     }
+    if (r.len <= 0) continue;
+    r.anchored = memchr(r.pat, '/', r.len) != NULL;
+    if (r.len > 0 && r.pat[0] == '/') {
+      r.pat++;
+      r.len--;
+    }
+    if (r.len == 0) continue;
+    for (int i = 0; i < r.len; ++i) {
+      if (strchr("*?[\\", r.pat[i]) != NULL) r.literal = false;
+    }
+    ig->rules[ig->rules_sz++] = r;
+  }
+}
 
-    curpath_sz = oldsz;
+// ignore_load adds the rules of the file name in the directory dirfd to ig.
+// It creates ig if it's NULL and returns it. If mtime is set, it is raised to
+// the file's mtime.
+struct ignore *ignore_load(struct arena *a, int dirfd, const char *name,
+                           struct ignore *ig, const struct ignore *parent,
+                           int dir_len, struct timespec *mtime) {
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    HANDLE_CASE(errno != EACCES && errno != ENOENT && errno != ENOTDIR &&
+                errno != ELOOP);
+    return ig;
   }
+  struct stat s;
+  HANDLE_CASE(fstat(fd, &s) != 0);
+  if (mtime != NULL && timespec_after(s.st_mtim, *mtime)) *mtime = s.st_mtim;
+  if (S_ISREG(s.st_mode) && s.st_size > 0 && s.st_size < (1 << 24)) {
+    char *data = arena_alloc(a, s.st_size);
+    int sz = 0, rby;
+    while (sz < s.st_size && (rby = read(fd, data + sz, s.st_size - sz)) > 0) {
+      sz += rby;
+    }
+    if (ig == NULL) {
+      ig = arena_alloc8(a, sizeof(*ig));
+      memset(ig, 0, sizeof(*ig));
+      ig->parent = parent;
+      ig->dir_len = dir_len;
+    }
+    ignore_parse(a, ig, data, sz);
+  }
+  HANDLE_CASE(close(fd) != 0);
+  return ig;
 }
 
-void read_hierarchy(void) {
-  puts("reading directory hierarchy");
+// fd is -1 if the directory is not opened yet. path ends with a slash unless
+// it is the root. ignore has the rules of the parent directories. root is set
+// for the directories the crawl starts from, their parents' rules are loaded
+// when they are scanned.
+struct crawl_dir {
+  int fd;
+  const char *path;
+  int len;
+  const struct ignore *ignore;
+  bool root;
+};
+
+struct crawl_file {
+  const char *path;
+  int len;
+};
+
+// ignore_mtime is the newest mtime of the directory's ignore files, zero if
+// it has none.
+struct crawl_dirinfo {
+  const char *path;
+  int len;
+  struct timespec mtime;
+  struct timespec ignore_mtime;
+};
+
+// crawl_result holds the files and the directories of a crawl. The strings
+// live in the arenas.
+struct crawl_result {
+  struct crawl_file *files;
+  int files_sz, files_cap;
+  struct crawl_dirinfo *dirs;
+  int dirs_sz, dirs_cap;
+  struct arena arenas[CRAWL_THREADS_MAX];
+  int arenas_sz;
+};
 
-  DIR *dirp = opendir(curpath);
-  HANDLE_CASE(dirp == NULL);
-  read_subtree(dirp);
-  HANDLE_CASE(closedir(dirp) == -1);
+// grow makes room for one more element in the array of sz elements.
+void *grow(void *p, int sz, int *cap, int elemsz) {
+  if (sz < *cap) return p;
+  *cap = *cap == 0 ? 1024 : 2 * *cap;
+  HANDLE_CASE((p = realloc(p, (size_t)*cap * elemsz)) == NULL);
+  return p;
 }
 
-int matches_count;
-int selection;
-int first_match;
-void match_pattern(const char *pattern) {
-  bool exact_first = false;
-  bool exact_last = false;
+struct crawl_thread {
+  pthread_t thread;
 
-  if (pattern[0] == '^') {
-    exact_first = true;
-    pattern += 1;
+  // The deque is dirs[head..tail), guarded by mutex.
+  pthread_mutex_t mutex;
+  struct crawl_dir *dirs;
+  int head, tail, cap;
+
+  struct arena arena;
+  struct crawl_file *files;
+  int files_sz, files_cap, published;
+  double published_time;
+  struct crawl_dirinfo *dirinfos;
+  int dirinfos_sz, dirinfos_cap;
+  char *dents;
+};
+
+// pending counts the directories that are queued or being scanned, queued
+// counts the ones in the deques and idle counts the threads waiting for work.
+// These are atomics, the mutex and cond are only used for the idle threads.
+// skip_dir, if set, tells which subdirectories not to descend into. publish,
+// if set, gets each thread's files in batches of CRAWL_BATCH while it crawls.
+// A smaller batch goes out after CRAWL_PUBLISH_INTERVAL seconds and when the
+// thread runs out of work. pruned counts the entries left out because of the
+// ignore files.
+struct {
+  struct crawl_thread threads[CRAWL_THREADS_MAX];
+  int threads_sz;
+  int pending;
+  int queued;
+  int idle;
+  int open_fds;
+  int fd_budget;
+  int pruned;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool (*skip_dir)(const char *path, int len);
+  void (*publish)(const struct crawl_file *files, int files_sz);
+} crawl;
+
+void crawl_wake(void) {
+  HANDLE_CASE(pthread_mutex_lock(&crawl.mutex) != 0);
+  HANDLE_CASE(pthread_cond_broadcast(&crawl.cond) != 0);
+  HANDLE_CASE(pthread_mutex_unlock(&crawl.mutex) != 0);
+}
+
+void crawl_push(struct crawl_thread *t, const struct crawl_dir *d) {
+  HANDLE_CASE(pthread_mutex_lock(&t->mutex) != 0);
+  if (t->tail == t->cap) {
+    if (t->head > 0) {
+      memmove(t->dirs, t->dirs + t->head, (t->tail - t->head) * sizeof(*d));
+      t->tail -= t->head;
+      t->head = 0;
+    } else {
+      t->cap = t->cap == 0 ? 64 : 2 * t->cap;
+      t->dirs = realloc(t->dirs, t->cap * sizeof(*d));
+      HANDLE_CASE(t->dirs == NULL);
+    }
   }
-  int patlen = strlen(pattern);
-  if (patlen > 0 && pattern[patlen - 1] == '$') {
-    exact_last = true;
+  t->dirs[t->tail++] = *d;
+  HANDLE_CASE(pthread_mutex_unlock(&t->mutex) != 0);
+  __atomic_add_fetch(&crawl.pending, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&crawl.queued, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&crawl.idle, __ATOMIC_SEQ_CST) > 0) crawl_wake();
+}
+
+// crawl_take takes the newest directory from the deque, or the oldest one if
+// steal is set.
+bool crawl_take(struct crawl_thread *t, struct crawl_dir *d, bool steal) {
+  HANDLE_CASE(pthread_mutex_lock(&t->mutex) != 0);
+  bool ok = t->head < t->tail;
+  if (ok) *d = steal ? t->dirs[t->head++] : t->dirs[--t->tail];
+  HANDLE_CASE(pthread_mutex_unlock(&t->mutex) != 0);
+  if (ok) __atomic_sub_fetch(&crawl.queued, 1, __ATOMIC_SEQ_CST);
+  return ok;
+}
+
+// crawl_flush publishes the files of the thread's partial batch.
+void crawl_flush(struct crawl_thread *t) {
+  if (crawl.publish == NULL || t->files_sz == t->published) return;
+  crawl.publish(t->files + t->published, t->files_sz - t->published);
+  t->published = t->files_sz;
+  t->published_time = now();
+}
+
+// crawl_next returns false once all directories are scanned.
+bool crawl_next(struct crawl_thread *t, struct crawl_dir *d) {
+  int self = t - crawl.threads;
+  while (true) {
+    if (crawl_take(t, d, false)) return true;
+    for (int i = 1; i < crawl.threads_sz; ++i) {
+      int victim = (self + i) % crawl.threads_sz;
+      if (crawl_take(&crawl.threads[victim], d, true)) return true;
+    }
+    crawl_flush(t);
+    HANDLE_CASE(pthread_mutex_lock(&crawl.mutex) != 0);
+    __atomic_add_fetch(&crawl.idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&crawl.queued, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_load_n(&crawl.pending, __ATOMIC_SEQ_CST) > 0) {
+      HANDLE_CASE(pthread_cond_wait(&crawl.cond, &crawl.mutex) != 0);
+    }
+    __atomic_sub_fetch(&crawl.idle, 1, __ATOMIC_SEQ_CST);
+    bool done = __atomic_load_n(&crawl.pending, __ATOMIC_SEQ_CST) == 0;
+    HANDLE_CASE(pthread_mutex_unlock(&crawl.mutex) != 0);
+    if (done) return false;
   }
+}
 
-  char words[32][256];
-  int words_cnt = 0;
-  int offset = 0;
-  while (words_cnt < 32) {
-    int new_offset = 0;
-    const char *s = pattern + offset;
-    if (sscanf(s, "%255s%n", words[words_cnt], &new_offset) != 1) break;
-    offset += new_offset;
-    words_cnt += 1;
+void crawl_add_file(struct crawl_thread *t, const char *path, int len) {
+  t->files = grow(t->files, t->files_sz, &t->files_cap, sizeof(t->files[0]));
+  t->files[t->files_sz].path = path;
+  t->files[t->files_sz].len = len;
+  t->files_sz++;
+  if (t->files_sz - t->published == CRAWL_BATCH) crawl_flush(t);
+}
+
+// crawl_add_dir queues the subdirectory name of the directory open at fd.
+void crawl_add_dir(struct crawl_thread *t, int fd, const char *name,
+                   const char *path, int len, const struct ignore *ig) {
+  struct crawl_dir d = {-1, path, len, ig, false};
+  int open_fds = __atomic_add_fetch(&crawl.open_fds, 1, __ATOMIC_SEQ_CST);
+  if (open_fds > crawl.fd_budget) {
+    __atomic_sub_fetch(&crawl.open_fds, 1, __ATOMIC_SEQ_CST);
+  } else if ((d.fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ==
+             -1) {
+    __atomic_sub_fetch(&crawl.open_fds, 1, __ATOMIC_SEQ_CST);
+    HANDLE_CASE(errno != EACCES && errno != ENOENT && errno != ENOTDIR);
+    return;
   }
+  crawl_push(t, &d);
+}
 
-  int last_len = 0;
-  if (words_cnt > 0 && exact_last) {
-    int lw_len = strlen(words[words_cnt - 1]);
-    words[words_cnt - 1][lw_len - 1] = 0;
-    last_len = lw_len - 1;
+// crawl_ignore_parents loads the rules of the directories above the root d,
+// from curpath down.
+const struct ignore *crawl_ignore_parents(struct crawl_thread *t,
+                                          const struct crawl_dir *d) {
+  const struct ignore *ig = NULL;
+  char name[PATH_MAX + 16];
+  for (int len = curpath_sz; len < d->len;) {
+    memcpy(name, d->path, len);
+    strcpy(name + len, ".gitignore");
+    struct ignore *node =
+        ignore_load(&t->arena, AT_FDCWD, name, NULL, ig, len, NULL);
+    strcpy(name + len, ".ignore");
+    node = ignore_load(&t->arena, AT_FDCWD, name, node, ig, len, NULL);
+    if (node != NULL) ig = node;
+    const char *slash = memchr(d->path + len, '/', d->len - 1 - len);
+    if (slash == NULL) break;
+    len = slash - d->path + 1;
   }
+  return ig;
+}
 
-restart:
-  // We are doing exact matches except for capital letters. Capital
-  // letters can be preceded by any other characters.
-  first_match = -1;
+// crawl_ignore returns the rules for the entries of the directory d open at
+// fd. rby bytes of its entries are in dents. The ignore files are opened only
+// if they are among these or if the directory has more entries than these.
+// mtime is set to the newest mtime of the ignore files.
+const struct ignore *crawl_ignore(struct crawl_thread *t, int fd,
+                                  const struct crawl_dir *d, int rby,
+                                  struct timespec *mtime) {
+  const struct ignore *parent = d->ignore;
+  if (d->root && d->len > curpath_sz) parent = crawl_ignore_parents(t, d);
+  bool gitignore = rby > DENTS_BUF_SIZE / 2, dotignore = gitignore;
+  for (int off = 0; off < rby;) {
+    struct linux_dirent64 *ent = (void *)(t->dents + off);
+    off += ent->d_reclen;
+    if (ent->d_name[0] != '.') continue;
+    gitignore |= strcmp(ent->d_name, ".gitignore") == 0;
+    dotignore |= strcmp(ent->d_name, ".ignore") == 0;
+  }
+  struct ignore *ig = NULL;
+  if (gitignore) {
+    ig = ignore_load(&t->arena, fd, ".gitignore", ig, parent, d->len, mtime);
+  }
+  if (dotignore) {
+    ig = ignore_load(&t->arena, fd, ".ignore", ig, parent, d->len, mtime);
+  }
+  return ig != NULL ? ig : parent;
+}
 
-  char *buf = output_buffer;
-  memcpy(buf, "\e[s\e[J\n\n", 8);
-  buf += 7;
-
-  int matched = 0;
-  for (int i = 0; i < entries_sz; ++i) {
-    const struct entry *e = &entries[i];
-    const char *q = e->name_lower;
-    int qlen = e->len;
-    int word;
-
-    for (word = 0; word < words_cnt; ++word) {
-      if (word == 0 && exact_first) {
-        if (strstr(q, words[0]) != q) break;
-      } else if (word == words_cnt - 1 && exact_last) {
-        if (last_len > qlen) break;
-        const char *qe = q + qlen - last_len;
-        if (strcmp(qe, words[words_cnt - 1]) != 0) break;
-      } else if (strstr(q, words[word]) == NULL) {
-        break;
-      }
+void crawl_scan(struct crawl_thread *t, const struct crawl_dir *d) {
+  int fd = d->fd;
+  if (fd == -1) {
+    // The directory might be gone by now when refreshing the index.
+    fd = open(d->len == 0 ? "." : d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      HANDLE_CASE(errno != EACCES && errno != ENOENT && errno != ENOTDIR);
+      return;
     }
+    __atomic_add_fetch(&crawl.open_fds, 1, __ATOMIC_SEQ_CST);
+  }
+  struct stat s;
+  HANDLE_CASE(fstat(fd, &s) != 0);
+  t->dirinfos = grow(t->dirinfos, t->dirinfos_sz, &t->dirinfos_cap,
+                     sizeof(t->dirinfos[0]));
+  struct crawl_dirinfo *di = &t->dirinfos[t->dirinfos_sz++];
+  di->path = d->path;
+  di->len = d->len;
+  di->mtime = s.st_mtim;
+  di->ignore_mtime = (struct timespec){0, 0};
+  int rby = syscall(SYS_getdents64, fd, t->dents, DENTS_BUF_SIZE);
+  const struct ignore *ig =
+      use_ignore ? crawl_ignore(t, fd, d, rby, &di->ignore_mtime) : NULL;
+  for (; rby > 0; rby = syscall(SYS_getdents64, fd, t->dents, DENTS_BUF_SIZE)) {
+    for (int off = 0; off < rby;) {
+      struct linux_dirent64 *ent = (void *)(t->dents + off);
+      off += ent->d_reclen;
+      if (ent->d_name[0] == '.') continue;
+      int namelen = strlen(ent->d_name);
+      int len = d->len + namelen;
+      HANDLE_CASE(len + 1 >= PATH_MAX);
 
-    if (word == words_cnt) {
-      matched += 1;
+      int type = ent->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat s;
+        if (fstatat(fd, ent->d_name, &s, 0) == 0 && S_ISDIR(s.st_mode)) {
+          type = DT_DIR;
+        }
+      }
 
-      if (matched - 1 == selection) {
-        first_match = i;
-        memcpy(buf, " -> ", 4);
-      } else {
-        memcpy(buf, "    ", 4);
+      char *path = arena_alloc(&t->arena, len + 2);
+      memcpy(path, d->path, d->len);
+      memcpy(path + d->len, ent->d_name, namelen);
+      if (ig != NULL && ignored(ig, path, len, d->len, type == DT_DIR)) {
+        t->arena.used -= len + 2;
+        __atomic_add_fetch(&crawl.pruned, 1, __ATOMIC_RELAXED);
+        continue;
       }
-      buf += 4;
-      const char *s = e->name;
-      if (matched >= term_height - 3) {
-        s = "... and others ...";
-      } else if (qlen + 6 >= term_width) {
-        memcpy(buf, "...", 3);
-        buf += 3;
-        s = e->name + qlen - term_width + 8;
+      if (type == DT_DIR) {
+        path[len] = '/';
+        path[len + 1] = 0;
+        if (crawl.skip_dir != NULL && crawl.skip_dir(path, len + 1)) continue;
+        crawl_add_dir(t, fd, ent->d_name, path, len + 1, ig);
+      } else {
+        path[len] = 0;
+        crawl_add_file(t, path, len);
       }
-      int slen = strlen(s);
-      memcpy(buf, s, slen);
-      buf += slen;
-      *buf++ = '\n';
-      if (matched >= term_height - 3) break;
     }
   }
+  HANDLE_CASE(rby == -1);
+  HANDLE_CASE(close(fd) != 0);
+  __atomic_sub_fetch(&crawl.open_fds, 1, __ATOMIC_SEQ_CST);
+}
 
-  memcpy(buf, "\e[u", 3);
-  buf += 3;
-  swrite(1, output_buffer, buf - output_buffer);
-  rl_refresh_line(0, 0);
+void *crawl_main(void *arg) {
+  struct crawl_thread *t = arg;
+  struct crawl_dir d;
+  t->published_time = now();
+  while (crawl_next(t, &d)) {
+    crawl_scan(t, &d);
+    if (crawl.publish != NULL &&
+        now() - t->published_time >= CRAWL_PUBLISH_INTERVAL) {
+      crawl_flush(t);
+    }
+    if (__atomic_sub_fetch(&crawl.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+      crawl_wake();
+    }
+  }
+  return NULL;
+}
+
+// crawl_run crawls the roots on threads_sz threads into result.
+void crawl_run(int threads_sz, const struct crawl_dir *roots, int roots_sz,
+               struct crawl_result *result) {
+  struct rlimit rlim;
+  HANDLE_CASE(getrlimit(RLIMIT_NOFILE, &rlim) != 0);
+  crawl.fd_budget = rlim.rlim_cur / 2;
+  crawl.threads_sz = threads_sz;
+  crawl.open_fds = 0;
+  __atomic_store_n(&crawl.pruned, 0, __ATOMIC_RELAXED);
+  HANDLE_CASE(pthread_mutex_init(&crawl.mutex, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&crawl.cond, NULL) != 0);
+  for (int i = 0; i < threads_sz; ++i) {
+    struct crawl_thread *t = &crawl.threads[i];
+    HANDLE_CASE(pthread_mutex_init(&t->mutex, NULL) != 0);
+    HANDLE_CASE((t->dents = malloc(DENTS_BUF_SIZE)) == NULL);
+  }
+
+  for (int i = 0; i < roots_sz; ++i) {
+    struct crawl_dir d = roots[i];
+    d.root = true;
+    crawl_push(&crawl.threads[0], &d);
+  }
+  for (int i = 0; i < threads_sz; ++i) {
+    struct crawl_thread *t = &crawl.threads[i];
+    HANDLE_CASE(pthread_create(&t->thread, NULL, crawl_main, t) != 0);
+  }
+  for (int i = 0; i < threads_sz; ++i) {
+    HANDLE_CASE(pthread_join(crawl.threads[i].thread, NULL) != 0);
+  }
 
-  matches_count = matched;
-  if (matched > 0 && selection >= matched) {
-    selection = matched - 1;
-    goto restart;
+  memset(result, 0, sizeof(*result));
+  for (int i = 0; i < threads_sz; ++i) {
+    struct crawl_thread *t = &crawl.threads[i];
+    for (int j = 0; j < t->files_sz; ++j) {
+      result->files = grow(result->files, result->files_sz,
+                           &result->files_cap, sizeof(result->files[0]));
+      result->files[result->files_sz++] = t->files[j];
+    }
+    for (int j = 0; j < t->dirinfos_sz; ++j) {
+      result->dirs = grow(result->dirs, result->dirs_sz, &result->dirs_cap,
+                          sizeof(result->dirs[0]));
+      result->dirs[result->dirs_sz++] = t->dirinfos[j];
+    }
+    result->arenas[result->arenas_sz++] = t->arena;
+    free(t->files);
+    free(t->dirinfos);
+    free(t->dirs);
+    free(t->dents);
+    HANDLE_CASE(pthread_mutex_destroy(&t->mutex) != 0);
+    memset(t, 0, sizeof(*t));
   }
+  HANDLE_CASE(pthread_mutex_destroy(&crawl.mutex) != 0);
+  HANDLE_CASE(pthread_cond_destroy(&crawl.cond) != 0);
 }
 
-void noop(char *s) { (void)s; }
+void crawl_result_free(struct crawl_result *result) {
+  for (int i = 0; i < result->arenas_sz; ++i) arena_free(&result->arenas[i]);
+  free(result->files);
+  free(result->dirs);
+  memset(result, 0, sizeof(*result));
+}
 
-bool streq(const char *a, const char *b) { return strcmp(a, b) == 0; }
+int crawl_threads;
 
-int main(int argc, char **argv) {
-  for (int fd = 3; fd < 16; ++fd) close(fd);
+// paths_sort sorts the paths by their lowercase form with an MSD radix sort on
+// threads_sz threads. A range is partitioned by the byte at its depth into
+// 256 buckets, the paths that end there go first. The threads share the
+// ranges larger than SORT_SPLIT as tasks, they sort the smaller ones on their
+// own. A range recurses into all its buckets but the largest and loops on
+// that one, so the recursion is only logarithmically deep. Ranges of up to
+// SORT_SMALL paths are insertion sorted. The bytes of the counting pass are
+// kept in keys for the scatter pass, and a range whose paths share a prefix
+// skips it in one pass.
+enum { SORT_SPLIT = 1 << 16, SORT_SMALL = 32 };
 
-  curpath[0] = '.';
+struct sort_task {
+  int lo, hi, depth;
+};
 
-  int opt;
-  while ((opt = getopt(argc, argv, "u:")) != -1) {
-    if (opt == 'u') {
-      int n = atoi(optarg);
-      for (int i = 0; i < n; ++i) {
-        curpath[curpath_sz++] = '.';
-        curpath[curpath_sz++] = '.';
-        curpath[curpath_sz++] = '/';
+// pending counts the tasks that are queued or being partitioned.
+struct {
+  struct crawl_file *paths;
+  struct crawl_file *tmp;
+  unsigned char *keys;
+  struct sort_task *tasks;
+  int tasks_sz, tasks_cap;
+  int pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} sorter;
+
+int sort_key(const struct crawl_file *f, int depth) {
+  return depth < f->len ? tolower_table[(unsigned char)f->path[depth]] : 0;
+}
+
+void sort_small(struct crawl_file *a, int n, int depth) {
+  for (int i = 1; i < n; ++i) {
+    struct crawl_file f = a[i];
+    int j = i;
+    for (; j > 0 && lower_cmp(a[j - 1].path + depth, a[j - 1].len - depth,
+                              f.path + depth, f.len - depth) > 0;
+         --j) {
+      a[j] = a[j - 1];
+    }
+    a[j] = f;
+  }
+}
+
+// sort_partition partitions paths[lo..hi) into the buckets of the first byte
+// at or after *depth where the paths differ. The bucket b is
+// paths[start[b]..start[b + 1]). Returns false if all the paths are equal.
+bool sort_partition(int lo, int hi, int *depth, int *start) {
+  struct crawl_file *a = sorter.paths, *tmp = sorter.tmp;
+  unsigned char *keys = sorter.keys;
+  int count[256];
+  while (true) {
+    memset(count, 0, sizeof(count));
+    for (int i = lo; i < hi; ++i) {
+      if (i + 16 < hi) __builtin_prefetch(a[i + 16].path + *depth);
+      count[keys[i] = sort_key(&a[i], *depth)]++;
+    }
+    int key = keys[lo];
+    if (count[key] < hi - lo) break;
+    if (key == 0) return false;
+    int common = a[lo].len;
+    for (int i = lo + 1; i < hi && common > *depth + 1; ++i) {
+      int j = *depth + 1;
+      while (j < common && j < a[i].len &&
+             tolower_table[(unsigned char)a[i].path[j]] ==
+                 tolower_table[(unsigned char)a[lo].path[j]]) {
+        ++j;
       }
-    } else {
-      puts("file-selector [-u n] [entries...]");
-      puts("");
-      puts("-u n: go up n levels in the directory hierarchy");
-      exit(1);
+      common = j;
     }
+    *depth = common > *depth + 1 ? common : *depth + 1;
   }
+  start[0] = lo;
+  for (int b = 0; b < 256; ++b) start[b + 1] = start[b] + count[b];
+  int next[256];
+  memcpy(next, start, sizeof(next));
+  for (int i = lo; i < hi; ++i) tmp[next[keys[i]]++] = a[i];
+  memcpy(a + lo, tmp + lo, (hi - lo) * sizeof(a[0]));
+  return true;
+}
 
-  // Swap stdout with stderr so readline won't spam stdout where the
-  // result will go.
-  swap_fd(1, 2);
-  swrite(1, "\e[?1049h", 8);
-  swrite(1, "\e[H\e[2J", 7);
+void sort_range(int lo, int hi, int depth) {
+  while (hi - lo > SORT_SMALL) {
+    int start[257];
+    if (!sort_partition(lo, hi, &depth, start)) return;
+    int largest = 1;
+    for (int b = 2; b < 256; ++b) {
+      if (start[b + 1] - start[b] > start[largest + 1] - start[largest]) {
+        largest = b;
+      }
+    }
+    for (int b = 1; b < 256; ++b) {
+      if (b != largest) sort_range(start[b], start[b + 1], depth + 1);
+    }
+    lo = start[largest];
+    hi = start[largest + 1];
+    depth++;
+  }
+  sort_small(sorter.paths + lo, hi - lo, depth);
+}
 
-  get_term_dimensions();
-  tolower_table_calc();
+void sort_push(int lo, int hi, int depth) {
+  sorter.tasks = grow(sorter.tasks, sorter.tasks_sz, &sorter.tasks_cap,
+                      sizeof(sorter.tasks[0]));
+  sorter.tasks[sorter.tasks_sz++] = (struct sort_task){lo, hi, depth};
+  sorter.pending++;
+}
 
-  if (optind == argc) {
-    read_hierarchy();
+void *sort_main(void *arg) {
+  (void)arg;
+  HANDLE_CASE(pthread_mutex_lock(&sorter.mutex) != 0);
+  while (true) {
+    while (sorter.tasks_sz == 0 && sorter.pending > 0) {
+      HANDLE_CASE(pthread_cond_wait(&sorter.cond, &sorter.mutex) != 0);
+    }
+    if (sorter.tasks_sz == 0) break;
+    struct sort_task t = sorter.tasks[--sorter.tasks_sz];
+    HANDLE_CASE(pthread_mutex_unlock(&sorter.mutex) != 0);
+    int start[257];
+    bool split = t.hi - t.lo > SORT_SPLIT &&
+                 sort_partition(t.lo, t.hi, &t.depth, start);
+    if (!split) sort_range(t.lo, t.hi, t.depth);
+    HANDLE_CASE(pthread_mutex_lock(&sorter.mutex) != 0);
+    for (int b = 1; split && b < 256; ++b) {
+      if (start[b + 1] - start[b] > 1) {
+        sort_push(start[b], start[b + 1], t.depth + 1);
+      }
+    }
+    if (--sorter.pending == 0 || sorter.tasks_sz > 0) {
+      HANDLE_CASE(pthread_cond_broadcast(&sorter.cond) != 0);
+    }
+  }
+  HANDLE_CASE(pthread_mutex_unlock(&sorter.mutex) != 0);
+  return NULL;
+}
+
+void paths_sort(struct crawl_file *paths, int paths_sz, int threads_sz) {
+  if (paths_sz < 2) return;
+  sorter.paths = paths;
+  HANDLE_CASE((sorter.tmp = malloc(paths_sz * sizeof(paths[0]))) == NULL);
+  HANDLE_CASE((sorter.keys = malloc(paths_sz)) == NULL);
+  HANDLE_CASE(pthread_mutex_init(&sorter.mutex, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&sorter.cond, NULL) != 0);
+  sort_push(0, paths_sz, 0);
+  pthread_t threads[CRAWL_THREADS_MAX];
+  for (int i = 0; i < threads_sz; ++i) {
+    HANDLE_CASE(pthread_create(&threads[i], NULL, sort_main, NULL) != 0);
+  }
+  for (int i = 0; i < threads_sz; ++i) {
+    HANDLE_CASE(pthread_join(threads[i], NULL) != 0);
+  }
+  HANDLE_CASE(pthread_mutex_destroy(&sorter.mutex) != 0);
+  HANDLE_CASE(pthread_cond_destroy(&sorter.cond) != 0);
+  free(sorter.tmp);
+  free(sorter.keys);
+  free(sorter.tasks);
+  memset(&sorter, 0, sizeof(sorter));
+}
+
+uint64_t hash_more(uint64_t hash, const char *s, int len) {
+  for (int i = 0; i < len; ++i) {
+    hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+uint64_t path_hash(const char *path, int len) {
+  return hash_more(14695981039346656037ull, path, len);
+}
+
+// cache_dir sets dir to ~/.cache/file_selector and creates it if needed.
+// Returns false if there's no place for it.
+bool cache_dir(char *dir) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache != NULL && cache[0] != 0) {
+    snprintf(dir, PATH_MAX, "%s", cache);
+  } else if (home != NULL) {
+    snprintf(dir, PATH_MAX, "%s/.cache", home);
   } else {
-    for (int i = optind; i < argc; ++i) {
-      entry_add(argv[i], strlen(argv[i]));
+    return false;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+  if (strlen(dir) + 32 > PATH_MAX) return false;
+  strcat(dir, "/file_selector");
+  return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+// The history keeps the selections in ~/.cache/file_selector/history, one
+// per line as "<time> <count>\t<root>\t<path>". root is the real path of the
+// hierarchy and path is the selection relative to it. A selection appends a
+// line with count 1. The loading compacts the file once it has many more
+// lines than paths: the lines of a path become one with the newest time and
+// the sum of the counts, and the paths not selected in HISTORY_AGE_MAX
+// seconds are dropped. The paths of the current root get a boost from their
+// frecency, the count weighted by the age of the last selection. entry_boost
+// has the boosts of the entries so the matcher only adds them to the scores,
+// it is NULL if no entry has one. The history is a hash table of
+// "<root>\t<path>" keys, the slots hold the item's index plus one.
+enum { HISTORY_AGE_MAX = 90 * 86400, HISTORY_SLACK = 256 };
+enum { BOOST_STEP = 6, BOOST_MAX = 48 };
+
+struct history_item {
+  const char *key;
+  int key_len;
+  long long time;
+  long long count;
+  int boost;
+};
+
+struct history_item *history;
+int history_sz, history_cap;
+int *history_table;
+int history_table_cap;
+int history_boosts;
+char *history_data;
+char history_path[PATH_MAX + 16];
+char history_root[PATH_MAX + 1];
+int history_root_len;
+const uint8_t *entry_boost;
+uint8_t *own_boost;
+
+// history_find returns the index of the item with the key, -1 if there's
+// none.
+int history_find(const char *key, int len, uint64_t hash) {
+  int slot = hash & (history_table_cap - 1);
+  for (; history_table[slot] != 0;
+       slot = (slot + 1) & (history_table_cap - 1)) {
+    const struct history_item *h = &history[history_table[slot] - 1];
+    if (h->key_len == len && memcmp(h->key, key, len) == 0) {
+      return history_table[slot] - 1;
     }
   }
-  qsort(entries, entries_sz, sizeof entries[0], entry_cmp);
+  return -1;
+}
 
-  rl_callback_handler_install("fuzzy name: ", noop);
-  setup_fd();
+void history_add(const char *key, int len, long long time, long long count) {
+  if (2 * (history_sz + 1) > history_table_cap) {
+    int cap = history_table_cap == 0 ? 1024 : 2 * history_table_cap;
+    free(history_table);
+    HANDLE_CASE((history_table = calloc(cap, sizeof(int))) == NULL);
+    history_table_cap = cap;
+    for (int i = 0; i < history_sz; ++i) {
+      const struct history_item *h = &history[i];
+      int slot = path_hash(h->key, h->key_len) & (cap - 1);
+      while (history_table[slot] != 0) slot = (slot + 1) & (cap - 1);
+      history_table[slot] = i + 1;
+    }
+  }
+  uint64_t hash = path_hash(key, len);
+  int i = history_find(key, len, hash);
+  if (i != -1) {
+    if (history[i].time < time) history[i].time = time;
+    history[i].count += count;
+    return;
+  }
+  history = grow(history, history_sz, &history_cap, sizeof(history[0]));
+  history[history_sz] = (struct history_item){key, len, time, count, 0};
+  int slot = hash & (history_table_cap - 1);
+  while (history_table[slot] != 0) slot = (slot + 1) & (history_table_cap - 1);
+  history_table[slot] = ++history_sz;
+}
 
-  swrite(1, "\e[H\e[2J", 7);
-  match_pattern("");
-  while (true) {
-    char ch[8] = {};
-    int rby = read(5, ch, 7);
-    HANDLE_CASE(rby == -1);
-    if (rby == 1 && ch[0] == 27 && rl_end != 0) {
-      // Escape on nonempty string: clear pattern.
-      rl_delete_text(0, rl_end);
-      // Readline hack. Not sure why is this needed.
-      rl_callback_handler_install("fuzzy name: ", noop);
-      rby = 0;
-    } else if (rby == 0 || (rby == 1 && ch[0] == 27)) {
-      // Escape on empty string: quit,
-      reset_fd();
-      rl_deprep_terminal();
-      swrite(1, "\e[?1049l", 8);
-      exit(1);
-    } else if (ch[0] == 13) {
-      // Pressed Return.
-      reset_fd();
-      rl_deprep_terminal();
-      swrite(1, "\e[?1049l", 8);
-      if (first_match != -1) {
-        fputs(entries[first_match].name, stderr);
-        fputc('\n', stderr);
+// history_item_boost returns the boost of the item, 0 if it's of another
+// root.
+int history_item_boost(const struct history_item *h, long long t) {
+  if (h->key_len <= history_root_len ||
+      memcmp(h->key, history_root, history_root_len) != 0) {
+    return 0;
+  }
+  long long age = t - h->time, f = h->count;
+  if (age < 3600) {
+    f *= 16;
+  } else if (age < 86400) {
+    f *= 8;
+  } else if (age < 7 * 86400) {
+    f *= 4;
+  } else if (age < 30 * 86400) {
+    f *= 2;
+  }
+  int boost = 0;
+  for (; f > 0 && boost < BOOST_MAX; f >>= 1) boost += BOOST_STEP;
+  return boost;
+}
+
+// history_compact rewrites the history file with one line per item.
+void history_compact(void) {
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d", history_path, (int)getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) return;
+  for (int i = 0; i < history_sz; ++i) {
+    const struct history_item *h = &history[i];
+    fprintf(f, "%lld %lld\t%.*s\n", h->time, h->count, h->key_len, h->key);
+  }
+  if (fclose(f) != 0 || rename(tmp, history_path) != 0) unlink(tmp);
+}
+
+// history_load loads the selections and computes the boosts of the paths of
+// the current root.
+void history_load(void) {
+  char dir[PATH_MAX];
+  char root[PATH_MAX];
+  if (!cache_dir(dir)) return;
+  if (realpath(curpath_sz == 0 ? "." : curpath, root) == NULL) return;
+  snprintf(history_path, sizeof(history_path), "%s/history", dir);
+  history_root_len = snprintf(history_root, sizeof(history_root), "%s\t", root);
+
+  int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+  struct stat s;
+  HANDLE_CASE(fstat(fd, &s) != 0);
+  HANDLE_CASE((history_data = malloc(s.st_size + 1)) == NULL);
+  int sz = 0, rby;
+  while (sz < s.st_size &&
+         (rby = read(fd, history_data + sz, s.st_size - sz)) > 0) {
+    sz += rby;
+  }
+  HANDLE_CASE(close(fd) != 0);
+  history_data[sz] = 0;
+
+  long long t = time(NULL);
+  int lines = 0;
+  for (char *line = history_data, *end; line < history_data + sz;
+       line = end + 1) {
+    end = memchr(line, '\n', history_data + sz - line);
+    if (end == NULL) break;
+    *end = 0;
+    lines++;
+    long long when, count;
+    int key;
+    if (sscanf(line, "%lld %lld\t%n", &when, &count, &key) != 2) continue;
+    if (count <= 0 || t - when > HISTORY_AGE_MAX) continue;
+    history_add(line + key, end - line - key, when, count);
+  }
+  if (lines > 2 * history_sz + HISTORY_SLACK) history_compact();
+  for (int i = 0; i < history_sz; ++i) {
+    history[i].boost = history_item_boost(&history[i], t);
+    history_boosts += history[i].boost > 0;
+  }
+}
+
+// history_boost returns the boost of the entry with the path.
+uint8_t history_boost(const char *path, int len) {
+  if (history_boosts == 0) return 0;
+  if (len >= curpath_sz && memcmp(path, curpath, curpath_sz) == 0) {
+    path += curpath_sz;
+    len -= curpath_sz;
+  }
+  uint64_t hash = hash_more(path_hash(history_root, history_root_len), path,
+                            len);
+  char key[2 * PATH_MAX + 2];
+  if (history_root_len + len > (int)sizeof(key)) return 0;
+  memcpy(key, history_root, history_root_len);
+  memcpy(key + history_root_len, path, len);
+  int i = history_find(key, history_root_len + len, hash);
+  return i == -1 ? 0 : history[i].boost;
+}
+
+// history_record appends the selection of path to the history.
+void history_record(const char *path) {
+  if (history_root_len == 0) return;
+  int len = strlen(path);
+  if (len >= curpath_sz && memcmp(path, curpath, curpath_sz) == 0) {
+    path += curpath_sz;
+    len -= curpath_sz;
+  }
+  if (memchr(path, '\n', len) != NULL) return;
+  char *line;
+  int sz = asprintf(&line, "%lld 1\t%s%s\n", (long long)time(NULL),
+                    history_root, path);
+  HANDLE_CASE(sz == -1);
+  int fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    HANDLE_CASE(write(fd, line, sz) != sz);
+    HANDLE_CASE(close(fd) != 0);
+  }
+  free(line);
+}
+
+// The entries are kept as a struct of arrays. The names are laid out back to
+// back in names, in the order of the entries and each followed by a zero
+// byte. The lowercase names are laid out the same way in names_lower, followed
+// by SUBSTR_PAD zero bytes. entry_off is the offset of both names of an entry
+// and entry_base is the offset of its basename in them. The arrays point into
+// the mapped index or into the growable own_* arrays.
+enum { SUBSTR_PAD = 32 };
+
+int entries_sz;
+const uint32_t *entry_off;
+const uint16_t *entry_len;
+const uint16_t *entry_base;
+const char *names;
+const char *names_lower;
+uint32_t *own_off;
+uint16_t *own_len, *own_base;
+char *own_names, *own_lower;
+int own_cap;
+size_t own_names_sz, own_names_cap;
+
+// names_size returns the size of the names of the paths.
+size_t names_size(const struct crawl_file *paths, int paths_sz) {
+  size_t sz = 0;
+  for (int i = 0; i < paths_sz; ++i) sz += paths[i].len + 1;
+  return sz;
+}
+
+// entries_fill lays out the paths as entries with their names starting at
+// offset o. lower must have room for the padding. Returns the offset after the
+// names.
+uint32_t entries_fill(const struct crawl_file *paths, int paths_sz,
+                      uint32_t *off, uint16_t *len, uint16_t *base,
+                      char *name, char *lower, uint32_t o) {
+  for (int i = 0; i < paths_sz; ++i) {
+    const struct crawl_file *f = &paths[i];
+    HANDLE_CASE(f->len > UINT16_MAX);
+    const char *slash = memrchr(f->path, '/', f->len);
+    off[i] = o;
+    len[i] = f->len;
+    base[i] = slash == NULL ? 0 : slash - f->path + 1;
+    memcpy(name + o, f->path, f->len);
+    name[o + f->len] = 0;
+    for (int j = 0; j < f->len; ++j) {
+      lower[o + j] = tolower_table[(unsigned char)f->path[j]];
+    }
+    lower[o + f->len] = 0;
+    o += f->len + 1;
+  }
+  memset(lower + o, 0, SUBSTR_PAD);
+  return o;
+}
+
+// entries_append appends the paths to the entries in the own_* arrays.
+void entries_append(const struct crawl_file *paths, int paths_sz) {
+  size_t sz = own_names_sz + names_size(paths, paths_sz);
+  HANDLE_CASE(sz > UINT32_MAX);
+  if (entries_sz + paths_sz > own_cap) {
+    own_cap = 2 * own_cap > entries_sz + paths_sz ? 2 * own_cap
+                                                  : entries_sz + paths_sz;
+    own_off = realloc(own_off, own_cap * sizeof(own_off[0]) + 1);
+    own_len = realloc(own_len, own_cap * sizeof(own_len[0]) + 1);
+    own_base = realloc(own_base, own_cap * sizeof(own_base[0]) + 1);
+    HANDLE_CASE(own_off == NULL || own_len == NULL || own_base == NULL);
+  }
+  if (sz + SUBSTR_PAD > own_names_cap) {
+    own_names_cap = 2 * own_names_cap > sz + SUBSTR_PAD ? 2 * own_names_cap
+                                                        : sz + SUBSTR_PAD;
+    own_names = realloc(own_names, own_names_cap);
+    own_lower = realloc(own_lower, own_names_cap);
+    HANDLE_CASE(own_names == NULL || own_lower == NULL);
+  }
+  entries_fill(paths, paths_sz, own_off + entries_sz, own_len + entries_sz,
+               own_base + entries_sz, own_names, own_lower, own_names_sz);
+  own_names_sz = sz;
+  entries_sz += paths_sz;
+  entry_off = own_off;
+  entry_len = own_len;
+  entry_base = own_base;
+  names = own_names;
+  names_lower = own_lower;
+}
+
+void entries_free(void) {
+  free(own_off);
+  free(own_len);
+  free(own_base);
+  free(own_names);
+  free(own_lower);
+  own_off = NULL;
+  own_len = own_base = NULL;
+  own_names = own_lower = NULL;
+  own_cap = 0;
+  own_names_sz = own_names_cap = 0;
+}
+
+// entries_boost computes the boosts of the sorted entries. The paths of the
+// history are binary searched so it doesn't look at every entry.
+void entries_boost(void) {
+  free(own_boost);
+  own_boost = NULL;
+  entry_boost = NULL;
+  if (history_boosts == 0) return;
+  HANDLE_CASE((own_boost = calloc(entries_sz + 1, 1)) == NULL);
+  entry_boost = own_boost;
+  char path[2 * PATH_MAX + 2];
+  for (int i = 0; i < history_sz; ++i) {
+    const struct history_item *h = &history[i];
+    int rel = h->key_len - history_root_len;
+    int len = curpath_sz + rel;
+    if (h->boost == 0 || len > (int)sizeof(path)) continue;
+    memcpy(path, curpath, curpath_sz);
+    memcpy(path + curpath_sz, h->key + history_root_len, rel);
+    int lo = 0, hi = entries_sz;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (lower_cmp(names + entry_off[mid], entry_len[mid], path, len) < 0) {
+        lo = mid + 1;
       } else {
-        exit(1);
+        hi = mid;
       }
-      exit(0);
-    } else if (ch[0] == 10 || ch[0] == 14 || streq(ch, "\e[B")) {
-      // Pressed ^J or ^N or Down.
-      if (matches_count > 0) {
-        selection += 1;
-        selection %= matches_count;
+    }
+    for (; lo < entries_sz &&
+           lower_cmp(names + entry_off[lo], entry_len[lo], path, len) == 0;
+         ++lo) {
+      if (memcmp(names + entry_off[lo], path, len) == 0) {
+        own_boost[lo] = h->boost;
       }
-      match_pattern(rl_line_buffer);
-      continue;
-    } else if (ch[0] == 11 || ch[0] == 16 || streq(ch, "\e[A")) {
-      // Pressed ^K or ^P or Up.
-      if (matches_count > 0) {
-        selection += matches_count - 1;
-        selection %= matches_count;
+    }
+  }
+}
+
+// entries_build makes the sorted paths the entries.
+void entries_build(const struct crawl_file *paths, int paths_sz) {
+  entries_sz = 0;
+  own_names_sz = 0;
+  entries_append(paths, paths_sz);
+  entries_boost();
+}
+
+// With -t a trigram index narrows the entries down before the matcher sees
+// them, and the words of at least three characters then have to match as
+// substrings instead of as subsequences. The bytes of the lowercase names
+// are mapped into 64 classes, so a trigram is an 18 bit id, and each id has
+// a posting list of the entries that have it, in ascending order. The lists
+// are delta encoded varints laid out back to back, list i is
+// postings[offs[i]..offs[i + 1]). A query decodes the shortest list of its
+// trigrams and intersects it with the next shortest ones as long as they are
+// not much longer than the candidates left. Different trigrams may share an
+// id, the matcher verifies the candidates anyway. The lists are built on up
+// to TRIGRAM_THREADS_MAX threads, each takes a range of the entries. The
+// first pass counts the bytes each thread's part of a list takes, the
+// second one encodes the parts right into their place. The index is part of
+// the on-disk index if there is one, otherwise it's built in memory when the
+// entries are complete.
+enum { TRIGRAM_IDS = 1 << 18, TRIGRAM_THREADS_MAX = 8 };
+enum { TRIGRAM_INTERSECT_RATIO = 16 };
+
+struct trigram_index {
+  const uint32_t *offs;
+  const uint8_t *postings;
+  uint32_t *own_offs;
+  uint8_t *own_postings;
+  double build_time;
+};
+
+bool use_trigrams;
+struct trigram_index trigrams;
+unsigned char trigram_class[256];
+
+void trigram_class_calc(void) {
+  for (int i = 0; i < 256; ++i) trigram_class[i] = 42 + i % 22;
+  for (int i = 'a'; i <= 'z'; ++i) trigram_class[i] = 1 + i - 'a';
+  for (int i = '0'; i <= '9'; ++i) trigram_class[i] = 27 + i - '0';
+  const char *punct = "/._- ";
+  for (int i = 0; punct[i] != 0; ++i) trigram_class[(int)punct[i]] = 37 + i;
+}
+
+int trigram_id(const char *p) {
+  return trigram_class[(unsigned char)p[0]] << 12 |
+         trigram_class[(unsigned char)p[1]] << 6 |
+         trigram_class[(unsigned char)p[2]];
+}
+
+int varint_len(uint32_t v) {
+  int n = 1;
+  for (; v >= 128; v >>= 7) n++;
+  return n;
+}
+
+// The per-thread arrays hold the entry plus one, 0 means none. prev starts as
+// the first entry of the thread's part and becomes the last entry before the
+// part in the second pass. bytes is the size of the part, then the position
+// to encode it at.
+struct trigram_builder {
+  const char *lower;
+  const uint32_t *off;
+  const uint16_t *len;
+  bool encode;
+  uint8_t *postings;
+};
+
+struct trigram_task {
+  pthread_t thread;
+  const struct trigram_builder *b;
+  int lo, hi;
+  uint32_t *prev;
+  uint32_t *last;
+  uint32_t *bytes;
+};
+
+void *trigram_main(void *arg) {
+  struct trigram_task *t = arg;
+  const struct trigram_builder *b = t->b;
+  uint8_t *out = b->postings;
+  for (int e = t->lo; e < t->hi; ++e) {
+    const char *name = b->lower + b->off[e];
+    uint32_t v = e + 1;
+    for (int i = 0; i + 3 <= b->len[e]; ++i) {
+      int id = trigram_id(name + i);
+      if (b->encode) {
+        if (t->prev[id] == v) continue;
+        uint32_t d = v - t->prev[id];
+        for (; d >= 128; d >>= 7) out[t->bytes[id]++] = d | 128;
+        out[t->bytes[id]++] = d;
+        t->prev[id] = v;
+      } else if (t->last[id] != v) {
+        if (t->last[id] == 0) {
+          t->prev[id] = v;
+        } else {
+          t->bytes[id] += varint_len(v - t->last[id]);
+        }
+        t->last[id] = v;
       }
-      match_pattern(rl_line_buffer);
-      continue;
     }
+  }
+  return NULL;
+}
+
+void trigram_run(struct trigram_task *tasks, int tasks_sz) {
+  for (int i = 0; i < tasks_sz; ++i) {
+    struct trigram_task *t = &tasks[i];
+    HANDLE_CASE(pthread_create(&t->thread, NULL, trigram_main, t) != 0);
+  }
+  for (int i = 0; i < tasks_sz; ++i) {
+    HANDLE_CASE(pthread_join(tasks[i].thread, NULL) != 0);
+  }
+}
+
+// trigram_build builds the posting lists of the n entries into offs and
+// postings. Returns false if they would be too big.
+bool trigram_build(const char *lower, const uint32_t *off, const uint16_t *len,
+                   int n, int threads, uint32_t **offs, uint8_t **postings) {
+  if (threads > TRIGRAM_THREADS_MAX) threads = TRIGRAM_THREADS_MAX;
+  if (threads > n / 4096 + 1) threads = n / 4096 + 1;
+  struct trigram_builder b = {lower, off, len, false, NULL};
+  struct trigram_task tasks[TRIGRAM_THREADS_MAX];
+  for (int i = 0; i < threads; ++i) {
+    struct trigram_task *t = &tasks[i];
+    t->b = &b;
+    t->lo = (long long)n * i / threads;
+    t->hi = (long long)n * (i + 1) / threads;
+    t->prev = calloc(TRIGRAM_IDS, sizeof(uint32_t));
+    t->last = calloc(TRIGRAM_IDS, sizeof(uint32_t));
+    t->bytes = calloc(TRIGRAM_IDS, sizeof(uint32_t));
+    HANDLE_CASE(t->prev == NULL || t->last == NULL || t->bytes == NULL);
+  }
+  trigram_run(tasks, threads);
+
+  // Add the size of the first delta of each part, it depends on the last
+  // entry of the part before.
+  uint64_t total = 0;
+  HANDLE_CASE((*offs = malloc((TRIGRAM_IDS + 1) * sizeof(uint32_t))) == NULL);
+  for (int id = 0; id < TRIGRAM_IDS; ++id) {
+    (*offs)[id] = total;
+    uint32_t prev = 0;
+    for (int i = 0; i < threads; ++i) {
+      struct trigram_task *t = &tasks[i];
+      if (t->last[id] == 0) continue;
+      uint32_t first = t->prev[id];
+      t->prev[id] = prev;
+      t->bytes[id] += varint_len(first - prev);
+      uint32_t sz = t->bytes[id];
+      t->bytes[id] = total;
+      total += sz;
+      prev = t->last[id];
+    }
+  }
+  bool ok = total < UINT32_MAX;
+  if (ok) {
+    (*offs)[TRIGRAM_IDS] = total;
+    HANDLE_CASE((*postings = malloc(total + 1)) == NULL);
+    b.encode = true;
+    b.postings = *postings;
+    trigram_run(tasks, threads);
+  } else {
+    free(*offs);
+    *offs = NULL;
+  }
+  for (int i = 0; i < threads; ++i) {
+    struct trigram_task *t = &tasks[i];
+    free(t->prev);
+    free(t->last);
+    free(t->bytes);
+  }
+  return ok;
+}
+
+// trigram_decode decodes the list of id into out. Returns the size.
+int trigram_decode(int id, int *out) {
+  const uint8_t *p = trigrams.postings + trigrams.offs[id];
+  const uint8_t *end = trigrams.postings + trigrams.offs[id + 1];
+  int n = 0;
+  uint32_t v = 0;
+  while (p < end) {
+    uint32_t d = 0;
+    for (int shift = 0;; shift += 7) {
+      d |= (uint32_t)(*p & 127) << shift;
+      if ((*p++ & 128) == 0) break;
+    }
+    v += d;
+    out[n++] = v - 1;
+  }
+  return n;
+}
+
+// trigram_intersect keeps the candidates that are in the list of id.
+int trigram_intersect(int id, int *cand, int cand_sz) {
+  const uint8_t *p = trigrams.postings + trigrams.offs[id];
+  const uint8_t *end = trigrams.postings + trigrams.offs[id + 1];
+  int n = 0, j = 0;
+  uint32_t v = 0;
+  while (p < end && j < cand_sz) {
+    uint32_t d = 0;
+    for (int shift = 0;; shift += 7) {
+      d |= (uint32_t)(*p & 127) << shift;
+      if ((*p++ & 128) == 0) break;
+    }
+    v += d;
+    int e = v - 1;
+    while (j < cand_sz && cand[j] < e) j++;
+    if (j < cand_sz && cand[j] == e) cand[n++] = cand[j++];
+  }
+  return n;
+}
+
+int trigram_size_cmp(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  uint32_t sx = trigrams.offs[x + 1] - trigrams.offs[x];
+  uint32_t sy = trigrams.offs[y + 1] - trigrams.offs[y];
+  if (sx != sy) return sx < sy ? -1 : 1;
+  return x - y;
+}
+
+int trigram_ids[32 * 256];
+int *trigram_cand;
+int trigram_cand_cap;
+
+// trigram_candidates sets cand to the sorted entries that may contain the
+// words of at least three characters. cand must have room for all the
+// entries. Returns -1 if there are no such words.
+int trigram_candidates(char words[][256], const int *lens, int words_cnt,
+                       int *cand) {
+  if (trigrams.offs == NULL) return -1;
+  int *ids = trigram_ids;
+  int ids_sz = 0;
+  for (int w = 0; w < words_cnt; ++w) {
+    for (int i = 0; i + 3 <= lens[w]; ++i) {
+      ids[ids_sz++] = trigram_id(words[w] + i);
+    }
+  }
+  if (ids_sz == 0) return -1;
+  qsort(ids, ids_sz, sizeof(ids[0]), trigram_size_cmp);
+  int n = trigram_decode(ids[0], cand);
+  for (int i = 1; i < ids_sz && n > 0; ++i) {
+    if (ids[i] == ids[i - 1]) continue;
+    uint32_t sz = trigrams.offs[ids[i] + 1] - trigrams.offs[ids[i]];
+    if (sz > (uint64_t)TRIGRAM_INTERSECT_RATIO * n) break;
+    n = trigram_intersect(ids[i], cand, n);
+  }
+  return n;
+}
+
+void trigram_free(void) {
+  free(trigrams.own_offs);
+  free(trigrams.own_postings);
+  memset(&trigrams, 0, sizeof(trigrams));
+}
+
+// trigram_entries builds the trigram index of the entries in memory.
+void trigram_entries(void) {
+  trigram_free();
+  if (!use_trigrams) return;
+  double start = now();
+  if (trigram_build(names_lower, entry_off, entry_len, entries_sz,
+                    crawl_threads, &trigrams.own_offs,
+                    &trigrams.own_postings)) {
+    trigrams.offs = trigrams.own_offs;
+    trigrams.postings = trigrams.own_postings;
+  }
+  trigrams.build_time = now() - start;
+}
+
+// The index caches the crawl of a root in ~/.cache/file_selector/<hash>. The
+// entries point right into the mapped index so a launch doesn't need to crawl.
+// A background thread then rescans only the directories whose mtime changed,
+// writes a new index and the main loop switches to it. The layout is the
+// header, the key, the dirs, the entry_off, entry_len and entry_base arrays of
+// the files and the strings. The strings are the paths of the dirs, then the
+// names and the lowercase names of the files laid out like the entries' ones.
+// names and names_lower are their offsets in the strings. The key is the real
+// path of the root and the path prefix of the entries. A dir's ignore_sec and
+// ignore_nsec are the newest mtime of its ignore files, zero if it has none.
+// Editing them doesn't change the dir's mtime so the refresh checks them
+// separately.
+struct index_header {
+  char magic[8];
+  uint32_t key_len;
+  uint32_t dirs_sz;
+  uint32_t files_sz;
+  uint32_t strings_sz;
+  uint32_t names;
+  uint32_t names_lower;
+  uint32_t trigrams;
+  uint32_t postings_sz;
+};
+
+struct index_dir {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ignore_sec;
+  int64_t ignore_nsec;
+  uint32_t path;
+  uint32_t len;
+};
+
+struct index {
+  char *map;
+  size_t map_sz;
+  const struct index_header *header;
+  const struct index_dir *dirs;
+  const uint32_t *off;
+  const uint16_t *len;
+  const uint16_t *base;
+  const char *strings;
+  const uint32_t *trigram_offs;
+  const uint8_t *postings;
+};
+
+const char index_magic[8] = "fsindex5";
+bool use_index = true;
+int index_key_len;
+char index_key[2 * PATH_MAX + 8];
+char index_path[PATH_MAX + 64];
+struct index index_cur;
+
+size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// index_layout computes the offsets of the index parts. Returns the size.
+size_t index_layout(const struct index_header *h, size_t *dirs, size_t *files,
+                    size_t *strings, size_t *trigrams) {
+  *dirs = align8(sizeof(*h) + h->key_len);
+  *files = *dirs + (size_t)h->dirs_sz * sizeof(struct index_dir);
+  *strings = *files + (size_t)h->files_sz * 8;
+  *trigrams = align8(*strings + h->strings_sz);
+  if (!h->trigrams) return *strings + h->strings_sz;
+  return *trigrams + (TRIGRAM_IDS + 1) * 4 + (size_t)h->postings_sz;
+}
+
+// index_init computes the key and the path of the index. Returns false if
+// there's no place for the index.
+bool index_init(void) {
+  char root[PATH_MAX];
+  if (realpath(curpath_sz == 0 ? "." : curpath, root) == NULL) return false;
+  index_key_len =
+      sprintf(index_key, "%s\n%s\n%s%s", root, curpath_sz ? curpath : "",
+              use_ignore ? "" : "-I", use_trigrams ? "-t" : "");
+  uint64_t hash = path_hash(index_key, index_key_len);
+  char dir[PATH_MAX];
+  if (!cache_dir(dir)) return false;
+  sprintf(index_path, "%s/%016llx", dir, (unsigned long long)hash);
+  return true;
+}
+
+bool write_all(int fd, const void *data, size_t sz) {
+  for (size_t done = 0; done < sz;) {
+    ssize_t wby = write(fd, (const char *)data + done, sz - done);
+    if (wby <= 0) return false;
+    done += wby;
+  }
+  return true;
+}
+
+// index_write writes the sorted files and the dirs into a new index. Returns
+// false on failure.
+bool index_write(const struct crawl_file *files, int files_sz,
+                 const struct crawl_dirinfo *dirs, int dirs_sz) {
+  struct index_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, index_magic, sizeof(h.magic));
+  h.key_len = index_key_len;
+  h.dirs_sz = dirs_sz;
+  h.files_sz = files_sz;
+  size_t dirs_strings_sz = 0;
+  for (int i = 0; i < dirs_sz; ++i) dirs_strings_sz += dirs[i].len + 1;
+  size_t names_sz = names_size(files, files_sz);
+  size_t strings_sz = dirs_strings_sz + 2 * names_sz + SUBSTR_PAD;
+  if (strings_sz > UINT32_MAX) return false;
+  h.strings_sz = strings_sz;
+  h.names = dirs_strings_sz;
+  h.names_lower = dirs_strings_sz + names_sz;
+  size_t dirs_off, files_off, strings_off, trigrams_off;
+  size_t sz = index_layout(&h, &dirs_off, &files_off, &strings_off,
+                           &trigrams_off);
+  sz = trigrams_off;
+  char *image = calloc(sz, 1);
+  HANDLE_CASE(image == NULL);
+  memcpy(image, &h, sizeof(h));
+  memcpy(image + sizeof(h), index_key, index_key_len);
+
+  char *strings = image + strings_off;
+  uint32_t off = 0;
+  struct index_dir *idirs = (void *)(image + dirs_off);
+  for (int i = 0; i < dirs_sz; ++i) {
+    idirs[i].mtime_sec = dirs[i].mtime.tv_sec;
+    idirs[i].mtime_nsec = dirs[i].mtime.tv_nsec;
+    idirs[i].ignore_sec = dirs[i].ignore_mtime.tv_sec;
+    idirs[i].ignore_nsec = dirs[i].ignore_mtime.tv_nsec;
+    idirs[i].path = off;
+    idirs[i].len = dirs[i].len;
+    memcpy(strings + off, dirs[i].path, dirs[i].len);
+    off += dirs[i].len + 1;
+  }
+  size_t n = files_sz;
+  entries_fill(files, files_sz, (void *)(image + files_off),
+               (void *)(image + files_off + 4 * n),
+               (void *)(image + files_off + 6 * n), strings + h.names,
+               strings + h.names_lower, 0);
+  uint32_t *offs = NULL;
+  uint8_t *postings = NULL;
+  if (use_trigrams &&
+      trigram_build(strings + h.names_lower, (void *)(image + files_off),
+                    (void *)(image + files_off + 4 * n), files_sz,
+                    crawl_threads, &offs, &postings)) {
+    h.trigrams = 1;
+    h.postings_sz = offs[TRIGRAM_IDS];
+    memcpy(image, &h, sizeof(h));
+  }
+
+  char tmppath[sizeof(index_path) + 16];
+  snprintf(tmppath, sizeof(tmppath), "%s.%d", index_path, (int)getpid());
+  int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (!h.trigrams) sz = strings_off + h.strings_sz;
+  bool ok = fd != -1 && write_all(fd, image, sz);
+  if (ok && h.trigrams) {
+    ok = write_all(fd, offs, (TRIGRAM_IDS + 1) * 4) &&
+         write_all(fd, postings, h.postings_sz);
+  }
+  if (fd != -1) ok = close(fd) == 0 && ok;
+  if (ok) ok = rename(tmppath, index_path) == 0;
+  if (!ok) unlink(tmppath);
+  free(image);
+  free(offs);
+  free(postings);
+  return ok;
+}
+
+// index_load maps the index. Returns false if there's no usable index.
+bool index_load(struct index *ix) {
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat s;
+  HANDLE_CASE(fstat(fd, &s) != 0);
+  memset(ix, 0, sizeof(*ix));
+  ix->map_sz = s.st_size;
+  if (ix->map_sz >= sizeof(struct index_header)) {
+    ix->map = mmap(NULL, ix->map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    HANDLE_CASE(ix->map == MAP_FAILED);
+  }
+  HANDLE_CASE(close(fd) != 0);
+  if (ix->map == NULL) return false;
+
+  const struct index_header *h = (void *)ix->map;
+  size_t dirs_off, files_off, strings_off, trigrams_off;
+  bool ok = memcmp(h->magic, index_magic, sizeof(h->magic)) == 0;
+  ok = ok && index_layout(h, &dirs_off, &files_off, &strings_off,
+                          &trigrams_off) == ix->map_sz;
+  ok = ok && (int)h->key_len == index_key_len;
+  ok = ok && memcmp(ix->map + sizeof(*h), index_key, index_key_len) == 0;
+  ok = ok && h->names <= h->names_lower &&
+       (size_t)h->names_lower + SUBSTR_PAD <= h->strings_sz;
+  ok = ok && (!h->trigrams ||
+              ((const uint32_t *)(ix->map + trigrams_off))[TRIGRAM_IDS] ==
+                  h->postings_sz);
+  if (!ok) {
+    HANDLE_CASE(munmap(ix->map, ix->map_sz) != 0);
+    ix->map = NULL;
+    return false;
+  }
+  ix->header = h;
+  ix->dirs = (void *)(ix->map + dirs_off);
+  ix->off = (void *)(ix->map + files_off);
+  ix->len = (void *)(ix->map + files_off + 4 * (size_t)h->files_sz);
+  ix->base = (void *)(ix->map + files_off + 6 * (size_t)h->files_sz);
+  ix->strings = ix->map + strings_off;
+  if (h->trigrams) {
+    ix->trigram_offs = (void *)(ix->map + trigrams_off);
+    ix->postings = (void *)(ix->trigram_offs + TRIGRAM_IDS + 1);
+  }
+  return true;
+}
+
+// index_entries points the entries to the current index.
+void index_entries(void) {
+  const struct index *ix = &index_cur;
+  entries_sz = ix->header->files_sz;
+  entry_off = ix->off;
+  entry_len = ix->len;
+  entry_base = ix->base;
+  names = ix->strings + ix->header->names;
+  names_lower = ix->strings + ix->header->names_lower;
+  entries_boost();
+  if (ix->trigram_offs == NULL) {
+    trigram_entries();
+  } else {
+    trigram_free();
+    trigrams.offs = ix->trigram_offs;
+    trigrams.postings = ix->postings;
+  }
+}
+
+// The refresh thread writes a byte into index_refresh_fd when it is done: 'u'
+// if it wrote a new index, 's' if the index is still up to date.
+pthread_t index_refresh_thread;
+int index_refresh_fd[2] = {-1, -1};
+
+// The refresh marks the directories of the current index with these. The
+// table is an open addressing hash table of their paths, the slots hold the
+// directory's index plus one.
+enum { DIR_GONE, DIR_SAME, DIR_CHANGED };
+char *index_dir_state;
+int *index_dir_table;
+int index_dir_cap;
+
+// index_dir_find returns the index of the current index's directory with the
+// given path, -1 if there's none.
+int index_dir_find(const char *path, int len) {
+  const struct index *ix = &index_cur;
+  int slot = path_hash(path, len) & (index_dir_cap - 1);
+  for (; index_dir_table[slot] != 0; slot = (slot + 1) & (index_dir_cap - 1)) {
+    const struct index_dir *d = &ix->dirs[index_dir_table[slot] - 1];
+    if ((int)d->len == len && memcmp(ix->strings + d->path, path, len) == 0) {
+      return index_dir_table[slot] - 1;
+    }
+  }
+  return -1;
+}
+
+// index_skip_dir skips the directories that the refresh handles on their own.
+bool index_skip_dir(const char *path, int len) {
+  int i = index_dir_find(path, len);
+  return i != -1 && index_dir_state[i] != DIR_GONE;
+}
+
+// index_rules_changed tells whether the ignore files in the directory d are
+// different from the ones the index recorded: added, removed or modified.
+bool index_rules_changed(const struct index_dir *d, const char *path) {
+  if (!use_ignore) return false;
+  const char *names[] = {".gitignore", ".ignore"};
+  struct timespec newest = {0, 0};
+  for (int i = 0; i < 2; ++i) {
+    char name[PATH_MAX + 16];
+    snprintf(name, sizeof(name), "%s%s", path, names[i]);
+    struct stat s;
+    if (stat(name, &s) != 0) continue;
+    if (timespec_after(s.st_mtim, newest)) newest = s.st_mtim;
+  }
+  return newest.tv_sec != d->ignore_sec || newest.tv_nsec != d->ignore_nsec;
+}
+
+void *index_refresh(void *arg) {
+  (void)arg;
+  const struct index *ix = &index_cur;
+  int dirs_sz = ix->header->dirs_sz;
+  index_dir_cap = 16;
+  while (index_dir_cap < 2 * dirs_sz) index_dir_cap *= 2;
+  index_dir_table = calloc(index_dir_cap, sizeof(index_dir_table[0]));
+  index_dir_state = calloc(dirs_sz + 1, 1);
+  struct crawl_dir *roots = calloc(dirs_sz + 1, sizeof(roots[0]));
+  HANDLE_CASE(!index_dir_table || !index_dir_state || !roots);
+
+  int roots_sz = 0;
+  bool changed = false, rules_changed = false;
+  for (int i = 0; i < dirs_sz; ++i) {
+    const struct index_dir *d = &ix->dirs[i];
+    const char *path = ix->strings + d->path;
+    int slot = path_hash(path, d->len) & (index_dir_cap - 1);
+    while (index_dir_table[slot] != 0) slot = (slot + 1) & (index_dir_cap - 1);
+    index_dir_table[slot] = i + 1;
+
+    struct stat s;
+    if (stat(d->len == 0 ? "." : path, &s) != 0 || !S_ISDIR(s.st_mode)) {
+      index_dir_state[i] = DIR_GONE;
+      changed = true;
+    } else if (s.st_mtim.tv_sec == d->mtime_sec &&
+               s.st_mtim.tv_nsec == d->mtime_nsec) {
+      index_dir_state[i] = DIR_SAME;
+      // An ignore file can be edited in place without changing the dir.
+      if (d->ignore_sec != 0 || d->ignore_nsec != 0) {
+        rules_changed = rules_changed || index_rules_changed(d, path);
+      }
+    } else {
+      index_dir_state[i] = DIR_CHANGED;
+      roots[roots_sz].fd = -1;
+      roots[roots_sz].path = path;
+      roots[roots_sz].len = d->len;
+      roots_sz++;
+      changed = true;
+      rules_changed = rules_changed || index_rules_changed(d, path);
+    }
+  }
+  // New ignore rules apply to the unchanged subdirectories too so then the
+  // whole hierarchy is crawled again.
+  if (rules_changed) {
+    changed = true;
+    memset(index_dir_state, DIR_GONE, dirs_sz);
+    roots_sz = 1;
+    memset(roots, 0, sizeof(roots[0]));
+    roots[0].fd = -1;
+    roots[0].path = curpath;
+    roots[0].len = curpath_sz;
+  }
+
+  bool written = false;
+  if (changed) {
+    // The changed directories are rescanned, the new subdirectories are
+    // crawled fully. The unchanged ones are taken from the current index.
+    struct crawl_result result;
+    crawl.skip_dir = index_skip_dir;
+    crawl_run(crawl_threads, roots, roots_sz, &result);
+    crawl.skip_dir = NULL;
+    for (int i = 0; i < dirs_sz; ++i) {
+      if (index_dir_state[i] != DIR_SAME) continue;
+      const struct index_dir *d = &ix->dirs[i];
+      result.dirs = grow(result.dirs, result.dirs_sz, &result.dirs_cap,
+                         sizeof(result.dirs[0]));
+      struct crawl_dirinfo *di = &result.dirs[result.dirs_sz++];
+      di->path = ix->strings + d->path;
+      di->len = d->len;
+      di->mtime.tv_sec = d->mtime_sec;
+      di->mtime.tv_nsec = d->mtime_nsec;
+      di->ignore_mtime.tv_sec = d->ignore_sec;
+      di->ignore_mtime.tv_nsec = d->ignore_nsec;
+    }
+    for (int i = 0; i < (int)ix->header->files_sz; ++i) {
+      const char *path = ix->strings + ix->header->names + ix->off[i];
+      int dir = index_dir_find(path, ix->base[i]);
+      if (dir == -1 || index_dir_state[dir] != DIR_SAME) continue;
+      result.files = grow(result.files, result.files_sz, &result.files_cap,
+                          sizeof(result.files[0]));
+      result.files[result.files_sz].path = path;
+      result.files[result.files_sz].len = ix->len[i];
+      result.files_sz++;
+    }
+    paths_sort(result.files, result.files_sz, crawl_threads);
+    written = index_write(result.files, result.files_sz, result.dirs,
+                          result.dirs_sz);
+    crawl_result_free(&result);
+  }
+  free(index_dir_table);
+  free(index_dir_state);
+  free(roots);
+  HANDLE_CASE(write(index_refresh_fd[1], written ? "u" : "s", 1) != 1);
+  return NULL;
+}
+
+// index_refresh_done switches to the refreshed index. Returns true if the
+// entries changed.
+bool index_refresh_done(void) {
+  char ch;
+  HANDLE_CASE(read(index_refresh_fd[0], &ch, 1) != 1);
+  HANDLE_CASE(pthread_join(index_refresh_thread, NULL) != 0);
+  HANDLE_CASE(close(index_refresh_fd[0]) != 0);
+  HANDLE_CASE(close(index_refresh_fd[1]) != 0);
+  index_refresh_fd[0] = index_refresh_fd[1] = -1;
+  struct index ix;
+  if (ch != 'u' || !index_load(&ix)) return false;
+  HANDLE_CASE(munmap(index_cur.map, index_cur.map_sz) != 0);
+  index_cur = ix;
+  index_entries();
+  return true;
+}
+
+// index_refresh_start starts the refresh if the entries came from an index.
+// It must come after setup_fd because that expects the lowest fds to be free.
+void index_refresh_start(void) {
+  if (index_cur.map == NULL) return;
+  HANDLE_CASE(pipe2(index_refresh_fd, O_CLOEXEC) != 0);
+  HANDLE_CASE(pthread_create(&index_refresh_thread, NULL, index_refresh,
+                             NULL) != 0);
+}
+
+// read_index loads the entries from the index. Returns false if there's no
+// index, the hierarchy needs a crawl then.
+bool index_usable;
+bool read_index(void) {
+  index_usable = use_index && index_init();
+  if (!index_usable || !index_load(&index_cur)) return false;
+  index_entries();
+  return true;
+}
+
+// The stream crawls the hierarchy, or reads the entries from stdin, in the
+// background while the user types. The thread publishes the files in batches,
+// the main loop appends them to the entries at most every STREAM_INTERVAL
+// seconds and reruns the match. When the crawl is done the thread sorts the
+// files and writes the index, then the main loop switches to the sorted
+// entries. The thread writes 'b' into fd
+// when there's a new batch, unless it is already notified, and 'd' when it is
+// done.
+#define STREAM_INTERVAL 0.1
+struct {
+  bool active;
+  pthread_t thread;
+  int fd[2];
+  pthread_mutex_t mutex;
+  struct crawl_file *files;
+  int files_sz, files_cap, taken;
+  bool notified;
+  bool written;
+  struct crawl_result result;
+} stream;
+
+void stream_publish(const struct crawl_file *files, int files_sz) {
+  HANDLE_CASE(pthread_mutex_lock(&stream.mutex) != 0);
+  for (int i = 0; i < files_sz; ++i) {
+    stream.files = grow(stream.files, stream.files_sz, &stream.files_cap,
+                        sizeof(stream.files[0]));
+    stream.files[stream.files_sz++] = files[i];
+  }
+  bool notify = !stream.notified;
+  stream.notified = true;
+  HANDLE_CASE(pthread_mutex_unlock(&stream.mutex) != 0);
+  if (notify) HANDLE_CASE(write(stream.fd[1], "b", 1) != 1);
+}
+
+void *stream_main(void *arg) {
+  (void)arg;
+  struct crawl_dir root = {-1, curpath, curpath_sz, NULL, true};
+  struct crawl_result *result = &stream.result;
+  crawl.publish = stream_publish;
+  crawl_run(crawl_threads, &root, 1, result);
+  crawl.publish = NULL;
+  paths_sort(result->files, result->files_sz, crawl_threads);
+  stream.written = index_usable && index_write(result->files, result->files_sz,
+                                               result->dirs, result->dirs_sz);
+  HANDLE_CASE(write(stream.fd[1], "d", 1) != 1);
+  return NULL;
+}
+
+// stdin_main reads the entries from stdin_fd. They are separated by NULs if
+// the first read has a NUL in it, by newlines otherwise. Empty lines and the
+// ones longer than UINT16_MAX are skipped.
+enum { STDIN_CHUNK = 1024 * 1024 };
+int stdin_fd = -1;
+
+void stdin_add(struct crawl_result *result, const char *line, int len) {
+  if (len == 0 || len > UINT16_MAX) return;
+  char *path = arena_alloc(&result->arenas[0], len + 1);
+  memcpy(path, line, len);
+  path[len] = 0;
+  result->files = grow(result->files, result->files_sz, &result->files_cap,
+                       sizeof(result->files[0]));
+  result->files[result->files_sz].path = path;
+  result->files[result->files_sz].len = len;
+  result->files_sz++;
+}
+
+void *stdin_main(void *arg) {
+  (void)arg;
+  struct crawl_result *result = &stream.result;
+  result->arenas_sz = 1;
+  char *buf = malloc(STDIN_CHUNK);
+  HANDLE_CASE(buf == NULL);
+  int have = 0, sep = -1, published = 0;
+  bool skipping = false;
+  while (true) {
+    int rby = read(stdin_fd, buf + have, STDIN_CHUNK - have);
+    if (rby == -1 && errno == EINTR) continue;
+    HANDLE_CASE(rby == -1);
+    if (sep == -1 && rby > 0) sep = memchr(buf, 0, rby) != NULL ? 0 : '\n';
+    have += rby;
+    int start = 0;
+    char *end;
+    while ((end = memchr(buf + start, sep, have - start)) != NULL) {
+      if (!skipping) stdin_add(result, buf + start, end - buf - start);
+      skipping = false;
+      start = end - buf + 1;
+    }
+    if (rby == 0) {
+      if (!skipping) stdin_add(result, buf + start, have - start);
+      break;
+    }
+    memmove(buf, buf + start, have - start);
+    have -= start;
+    if (have == STDIN_CHUNK) {
+      // The line doesn't fit into the buffer, skip it.
+      skipping = true;
+      have = 0;
+    }
+    if (result->files_sz > published) {
+      stream_publish(result->files + published, result->files_sz - published);
+      published = result->files_sz;
+    }
+  }
+  free(buf);
+  HANDLE_CASE(close(stdin_fd) != 0);
+  paths_sort(result->files, result->files_sz, crawl_threads);
+  HANDLE_CASE(write(stream.fd[1], "d", 1) != 1);
+  return NULL;
+}
+
+// stream_start starts the thread, fn is stream_main or stdin_main. It must
+// come after setup_fd because that expects the lowest fds to be free.
+void stream_start(void *(*fn)(void *)) {
+  stream.active = true;
+  HANDLE_CASE(pipe2(stream.fd, O_CLOEXEC) != 0);
+  HANDLE_CASE(pthread_mutex_init(&stream.mutex, NULL) != 0);
+  HANDLE_CASE(pthread_create(&stream.thread, NULL, fn, NULL) != 0);
+}
+
+// stream_take appends the new batches to the entries. Their boosts are
+// looked up one by one since they aren't sorted yet.
+void stream_take(void) {
+  HANDLE_CASE(pthread_mutex_lock(&stream.mutex) != 0);
+  int from = entries_sz;
+  entries_append(stream.files + stream.taken, stream.files_sz - stream.taken);
+  trigram_free();
+  if (history_boosts > 0) {
+    HANDLE_CASE((own_boost = realloc(own_boost, entries_sz + 1)) == NULL);
+    for (int i = from; i < entries_sz; ++i) {
+      own_boost[i] = history_boost(names + entry_off[i], entry_len[i]);
+    }
+    entry_boost = own_boost;
+  }
+  stream.taken = stream.files_sz;
+  stream.notified = false;
+  HANDLE_CASE(pthread_mutex_unlock(&stream.mutex) != 0);
+}
+
+// stream_done switches to the sorted entries of the finished crawl.
+void stream_done(void) {
+  HANDLE_CASE(pthread_join(stream.thread, NULL) != 0);
+  HANDLE_CASE(close(stream.fd[0]) != 0);
+  HANDLE_CASE(close(stream.fd[1]) != 0);
+  HANDLE_CASE(pthread_mutex_destroy(&stream.mutex) != 0);
+  struct crawl_result *result = &stream.result;
+  if (stream.written && index_load(&index_cur)) {
+    index_entries();
+    entries_free();
+  } else {
+    entries_build(result->files, result->files_sz);
+    trigram_entries();
+  }
+  crawl_result_free(result);
+  free(stream.files);
+  memset(&stream, 0, sizeof(stream));
+}
+
+// crawl_benchmark crawls the hierarchy with 1, 2, 4, ... up to crawl_threads
+// threads and prints the speed of each. The first crawl only warms up the
+// caches.
+void crawl_benchmark(void) {
+  struct crawl_dir root = {-1, curpath, curpath_sz, NULL, true};
+  struct crawl_result result;
+  crawl_run(crawl_threads, &root, 1, &result);
+  crawl_result_free(&result);
+  double base = 0;
+  for (int n = 1;; n = 2 * n < crawl_threads ? 2 * n : crawl_threads) {
+    double start = now();
+    crawl_run(n, &root, 1, &result);
+    double elapsed = now() - start;
+    int files = result.files_sz;
+    crawl_result_free(&result);
+    double rate = files / elapsed;
+    if (n == 1) base = rate;
+    printf("%2d threads: %d files in %.3f s, %.0f files/s, %.2fx, "
+           "%d pruned\n",
+           n, files, elapsed, rate, rate / base, crawl.pruned);
+    if (n == crawl_threads) break;
+  }
+}
+
+// trigram_benchmark builds the trigram index of the hierarchy with 1, 2, 4,
+// ... up to crawl_threads threads and prints the time and the size of each.
+void trigram_benchmark(void) {
+  struct crawl_dir root = {-1, curpath, curpath_sz, NULL, true};
+  struct crawl_result result;
+  crawl_run(crawl_threads, &root, 1, &result);
+  paths_sort(result.files, result.files_sz, crawl_threads);
+  entries_build(result.files, result.files_sz);
+  crawl_result_free(&result);
+  size_t names_sz = own_names_sz + SUBSTR_PAD;
+  for (int n = 1;; n = 2 * n < crawl_threads ? 2 * n : crawl_threads) {
+    uint32_t *offs;
+    uint8_t *postings;
+    double start = now();
+    bool ok = trigram_build(names_lower, entry_off, entry_len, entries_sz, n,
+                            &offs, &postings);
+    double elapsed = now() - start;
+    HANDLE_CASE(!ok);
+    size_t sz = (TRIGRAM_IDS + 1) * 4 + (size_t)offs[TRIGRAM_IDS];
+    printf("%2d threads: trigram index of %d entries in %.3f s, %.1f MiB, "
+           "%.1f bytes per entry, %.0f%% of the names\n",
+           n, entries_sz, elapsed, sz / 1048576.0,
+           (double)sz / (entries_sz > 0 ? entries_sz : 1),
+           100.0 * sz / (2 * names_sz));
+    free(offs);
+    free(postings);
+    if (n == crawl_threads) break;
+  }
+}
+
+// The substring kernels return the first occurrence of needle in
+// hay[0..len), NULL if there's none. They test 16 or 32 positions at once for
+// the first and the last character of the needle and compare the rest only at
+// the candidates where both match. They read up to SUBSTR_PAD bytes past the
+// end of hay. substr_vector is written with the compiler's vector extensions
+// so it compiles to NEON on ARM, there the bytes of the compare mask are
+// checked one by one instead of with a movemask.
+typedef const char *substr_fn(const char *hay, int len, const char *needle,
+                              int nlen);
+
+bool substr_verify(const char *p, const char *needle, int nlen) {
+  return nlen <= 2 || memcmp(p + 1, needle + 1, nlen - 2) == 0;
+}
+
+const char *substr_scalar(const char *hay, int len, const char *needle,
+                          int nlen) {
+  if (nlen == 0) return hay;
+  char first = needle[0], last = needle[nlen - 1];
+  for (int i = 0; i + nlen <= len; ++i) {
+    if (hay[i] == first && hay[i + nlen - 1] == last &&
+        substr_verify(hay + i, needle, nlen)) {
+      return hay + i;
+    }
+  }
+  return NULL;
+}
+
+typedef unsigned char v16u8 __attribute__((vector_size(16)));
+typedef signed char v16s8 __attribute__((vector_size(16)));
+
+const char *substr_vector(const char *hay, int len, const char *needle,
+                          int nlen) {
+  if (nlen == 0) return hay;
+  v16u8 first = (v16u8){0} + (unsigned char)needle[0];
+  v16u8 last = (v16u8){0} + (unsigned char)needle[nlen - 1];
+  for (int i = 0; i + nlen <= len; i += 16) {
+    v16u8 a, b;
+    memcpy(&a, hay + i, 16);
+    memcpy(&b, hay + i + nlen - 1, 16);
+    v16s8 eq = (a == first) & (b == last);
+    uint64_t lo, hi;
+    memcpy(&lo, &eq, 8);
+    memcpy(&hi, (char *)&eq + 8, 8);
+    if ((lo | hi) == 0) continue;
+    for (int k = 0; k < 16 && i + k + nlen <= len; ++k) {
+      if (eq[k] && substr_verify(hay + i + k, needle, nlen)) return hay + i + k;
+    }
+  }
+  return NULL;
+}
+
+#ifdef __x86_64__
+const char *substr_sse2(const char *hay, int len, const char *needle,
+                        int nlen) {
+  if (nlen == 0) return hay;
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+  for (int i = 0; i + nlen <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                               _mm_cmpeq_epi8(b, last));
+    unsigned mask = _mm_movemask_epi8(eq);
+    int left = len - nlen + 1 - i;
+    if (left < 16) mask &= (1u << left) - 1;
+    for (; mask != 0; mask &= mask - 1) {
+      const char *p = hay + i + __builtin_ctz(mask);
+      if (substr_verify(p, needle, nlen)) return p;
+    }
+  }
+  return NULL;
+}
+
+__attribute__((target("avx2"))) const char *substr_avx2(const char *hay,
+                                                         int len,
+                                                         const char *needle,
+                                                         int nlen) {
+  if (nlen == 0) return hay;
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+  for (int i = 0; i + nlen <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+    __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                  _mm256_cmpeq_epi8(b, last));
+    unsigned mask = _mm256_movemask_epi8(eq);
+    int left = len - nlen + 1 - i;
+    if (left < 32) mask &= (1u << left) - 1;
+    for (; mask != 0; mask &= mask - 1) {
+      const char *p = hay + i + __builtin_ctz(mask);
+      if (substr_verify(p, needle, nlen)) return p;
+    }
+  }
+  return NULL;
+}
+#endif
+
+substr_fn *substr_find = substr_vector;
+
+void substr_init(void) {
+#ifdef __x86_64__
+  substr_find = __builtin_cpu_supports("avx2") ? substr_avx2 : substr_sse2;
+#endif
+}
+
+const char *substr_strstr(const char *hay, int len, const char *needle,
+                          int nlen) {
+  (void)len;
+  (void)nlen;
+  return strstr(hay, needle);
+}
+
+// synthetic_path writes a generated lowercase path of at most SYNTHETIC_LEN
+// bytes into p and returns its length. rnd is the state of the generator.
+enum { SYNTHETIC_LEN = 96 };
+int synthetic_path(char *p, uint32_t *rnd) {
+  static const char *const parts[] = {
+      "src",    "lib",      "include", "linux", "net",   "core",  "util",
+      "test",   "file",     "selector", "drivers", "kernel", "arch", "x86",
+      "mm",     "fs",       "ext4",    "block", "crypto", "sound", "video",
+      "input",  "usb",      "pci",     "tools", "docs",  "scripts", "build",
+      "config", "internal", "common",  "main",
+  };
+  static const char *const exts[] = {".c", ".h", ".md", ".txt", ".py", ".sh"};
+  int nparts = sizeof(parts) / sizeof(parts[0]);
+  int nexts = sizeof(exts) / sizeof(exts[0]);
+  *rnd = *rnd * 1103515245 + 12345;
+  int len = 0, depth = 1 + (*rnd >> 16) % 4;
+  for (int d = 0; d < depth; ++d) {
+    *rnd = *rnd * 1103515245 + 12345;
+    len += sprintf(p + len, "%s/", parts[(*rnd >> 16) % nparts]);
+  }
+  *rnd = *rnd * 1103515245 + 12345;
+  len += sprintf(p + len, "%s%u%s", parts[(*rnd >> 16) % nparts], *rnd % 100,
+                 exts[(*rnd >> 8) % nexts]);
+  return len;
+}
+
+// substr_benchmark searches a generated corpus of a million lowercase paths
+// for a few needles with each kernel and with strstr. The times are the best
+// of three runs.
+void substr_benchmark(void) {
+  enum { PATHS = 1000000 };
+  static const char *const needles[] = {
+      "q", "x86", "zz", "ext4/", "selector", "7.h", "include/linux/net",
+  };
+  static const struct {
+    const char *name;
+    substr_fn *fn;
+  } kernels[] = {
+      {"strstr", substr_strstr},
+      {"scalar", substr_scalar},
+      {"vector", substr_vector},
+#ifdef __x86_64__
+      {"sse2", substr_sse2},
+      {"avx2", substr_avx2},
+#endif
+  };
+  int kernels_sz = sizeof(kernels) / sizeof(kernels[0]);
+#ifdef __x86_64__
+  if (!__builtin_cpu_supports("avx2")) kernels_sz--;
+#endif
+
+  char *corpus = calloc((size_t)PATHS * SYNTHETIC_LEN + SUBSTR_PAD, 1);
+  uint32_t *offs = malloc(PATHS * sizeof(offs[0]));
+  int *lens = malloc(PATHS * sizeof(lens[0]));
+  HANDLE_CASE(corpus == NULL || offs == NULL || lens == NULL);
+  uint32_t rnd = 1, off = 0;
+  for (int i = 0; i < PATHS; ++i) {
+    int len = synthetic_path(corpus + off, &rnd);
+    offs[i] = off;
+    lens[i] = len;
+    off += len + 1;
+  }
+  printf("%d paths, %.1f MiB\n", PATHS, off / 1048576.0);
+  printf("%-18s %7s", "needle", "hits");
+  for (int k = 0; k < kernels_sz; ++k) printf(" %8s", kernels[k].name);
+  printf("\n");
+
+  for (int n = 0; n < (int)(sizeof(needles) / sizeof(needles[0])); ++n) {
+    const char *needle = needles[n];
+    int nlen = strlen(needle);
+    int expected = -1;
+    printf("%-18s", needle);
+    for (int k = 0; k < kernels_sz; ++k) {
+      double best = 1e9;
+      int hits = 0;
+      for (int run = 0; run < 3; ++run) {
+        double start = now();
+        hits = 0;
+        for (int i = 0; i < PATHS; ++i) {
+          hits += kernels[k].fn(corpus + offs[i], lens[i], needle, nlen) != 0;
+        }
+        double elapsed = now() - start;
+        if (elapsed < best) best = elapsed;
+      }
+      if (expected == -1) printf(" %7d", expected = hits);
+      HANDLE_CASE(hits != expected);
+      printf(" %6.1fms", best * 1e3);
+    }
+    printf("\n");
+  }
+  free(corpus);
+  free(offs);
+  free(lens);
+}
+
+// The matcher scores every entry where each word of the pattern is a
+// subsequence of the lowercase name, loosely following fzf. Every matched
+// character scores, more at the start of the path components, after word
+// separators and on camel case humps. A run of consecutive matched characters
+// scores at least as much as its first character. Gaps cost. A word scores
+// the best of its shortest window and its first exact occurrence, found with
+// the substring kernel. A match in the basename scores extra. Only the best
+// rows are kept, in a heap whose root is the worst of them.
+enum {
+  SCORE_MATCH = 16,
+  SCORE_GAP_START = -3,
+  SCORE_GAP_EXTENSION = -1,
+  BONUS_SEPARATOR = 10,
+  BONUS_BOUNDARY = 8,
+  BONUS_CAMEL = 7,
+  BONUS_CONSECUTIVE = 4,
+  BONUS_BASENAME = 24,
+};
+enum { MATCHES_MAX = 1024 };
+
+struct match {
+  int score;
+  int entry;
+};
+
+int bonus_at(const char *name, int i) {
+  if (i == 0 || name[i - 1] == '/') return BONUS_SEPARATOR;
+  char prev = name[i - 1];
+  if (prev == '_' || prev == '-' || prev == '.' || prev == ' ') {
+    return BONUS_BOUNDARY;
+  }
+  if (!isupper_table[(unsigned char)prev] &&
+      isupper_table[(unsigned char)name[i]]) {
+    return BONUS_CAMEL;
+  }
+  return 0;
+}
+
+// fuzzy_window finds the shortest window of lower[from..len) that ends at the
+// earliest possible end and has word as a subsequence. The forward scan jumps
+// with memchr. Returns false if there's no such window.
+bool fuzzy_window(const char *lower, int from, int len, const char *word,
+                  int wlen, int *start, int *end) {
+  int i = from;
+  for (int j = 0; j < wlen; ++j) {
+    const char *p = memchr(lower + i, word[j], len - i);
+    if (p == NULL) return false;
+    i = p - lower + 1;
+  }
+  *end = i - 1;
+  int k = *end;
+  for (int j = wlen - 1; j >= 0; --k) {
+    if (lower[k] == word[j]) --j;
+  }
+  *start = k + 1;
+  return true;
+}
+
+// score_window scores the match of word in lower[start..end].
+int score_window(const char *name, const char *lower, int start, int end,
+                 const char *word, int wlen) {
+  int s = 0, gap = 0, run_bonus = 0, j = 0;
+  for (int i = start; i <= end && j < wlen; ++i) {
+    if (lower[i] != word[j]) {
+      s += gap++ == 0 ? SCORE_GAP_START : SCORE_GAP_EXTENSION;
+      continue;
+    }
+    int bonus = bonus_at(name, i);
+    if (i > start && gap == 0) {
+      if (bonus < run_bonus) bonus = run_bonus;
+      if (bonus < BONUS_CONSECUTIVE) bonus = BONUS_CONSECUTIVE;
+    } else {
+      run_bonus = bonus;
+    }
+    s += SCORE_MATCH + (j == 0 ? 2 * bonus : bonus);
+    gap = 0;
+    ++j;
+  }
+  return s;
+}
+
+// score_word sets the best score of word in lower[from..len). Returns false
+// if it doesn't match there.
+bool score_word(const char *name, const char *lower, int from, int len,
+                const char *word, int wlen, int *score) {
+  int start, end;
+  if (!fuzzy_window(lower, from, len, word, wlen, &start, &end)) return false;
+  int s = score_window(name, lower, start, end, word, wlen);
+  const char *p = substr_find(lower + from, len - from, word, wlen);
+  if (p != NULL) {
+    int exact = score_window(name, lower, p - lower, p - lower + wlen - 1,
+                             word, wlen);
+    if (exact > s) s = exact;
+  }
+  *score = s;
+  return true;
+}
+
+bool match_better(const struct match *a, const struct match *b) {
+  if (a->score != b->score) return a->score > b->score;
+  if (entry_len[a->entry] != entry_len[b->entry]) {
+    return entry_len[a->entry] < entry_len[b->entry];
+  }
+  return a->entry < b->entry;
+}
+
+int match_cmp(const void *a, const void *b) {
+  return match_better(a, b) ? -1 : match_better(b, a) ? 1 : 0;
+}
+
+int heap_sz;
+struct match heap[MATCHES_MAX];
+
+// heap_add adds m to the heap of the best k matches.
+void heap_add(struct match *heap, int *heap_sz, const struct match *m, int k) {
+  int i;
+  if (*heap_sz < k) {
+    i = (*heap_sz)++;
+    while (i > 0 && match_better(&heap[(i - 1) / 2], m)) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  } else if (match_better(m, &heap[0])) {
+    i = 0;
+    while (true) {
+      int c = 2 * i + 1;
+      if (c >= *heap_sz) break;
+      if (c + 1 < *heap_sz && match_better(&heap[c], &heap[c + 1])) ++c;
+      if (!match_better(m, &heap[c])) break;
+      heap[i] = heap[c];
+      i = c;
+    }
+  } else {
+    return;
+  }
+  heap[i] = *m;
+}
+
+// score_entry returns whether the entry matches the words and sets its score.
+bool score_entry(int entry, char words[][256], const int *lens, int words_cnt,
+                 bool exact_first, bool exact_last, int *score) {
+  const char *name = names + entry_off[entry];
+  const char *q = names_lower + entry_off[entry];
+  int qlen = entry_len[entry];
+  int base = entry_base[entry];
+  *score = 0;
+  for (int word = 0; word < words_cnt; ++word) {
+    const char *w = words[word];
+    int wlen = lens[word];
+    int from = 0, s;
+    if (word == 0 && exact_first) {
+      if (wlen > qlen || memcmp(q, w, wlen) != 0) return false;
+    } else if (word == words_cnt - 1 && exact_last) {
+      if (wlen > qlen || memcmp(q + qlen - wlen, w, wlen) != 0) return false;
+      from = qlen - wlen;
+    }
+    if (wlen == 0) continue;
+    if (use_trigrams && wlen >= 3 &&
+        substr_find(q + from, qlen - from, w, wlen) == NULL) {
+      return false;
+    }
+    // Most entries don't match so check the whole path first.
+    int start, end;
+    if (!fuzzy_window(q, from, qlen, w, wlen, &start, &end)) return false;
+    if (score_word(name, q, from > base ? from : base, qlen, w, wlen, &s)) {
+      s += BONUS_BASENAME;
+    } else {
+      score_word(name, q, from, qlen, w, wlen, &s);
+    }
+    *score += s;
+  }
+  return true;
+}
+
+bool streq(const char *a, const char *b) { return strcmp(a, b) == 0; }
+
+// screen_rows returns the number of rows that fit on the screen below the
+// prompt, one row is left for the "... and others ..." line.
+int screen_rows(void) {
+  int rows = term_height - 4;
+  if (rows < 1) rows = 1;
+  if (rows > MATCHES_MAX) rows = MATCHES_MAX;
+  return rows;
+}
+
+// The match cache is a stack of the entries that matched the recent
+// patterns, each pattern extends the one below it. Typing a character only
+// filters the entries of the top and backspace pops back to a cached set. A
+// pattern ending in $ anchors its last word, so a longer pattern doesn't
+// extend it. All entries form the implicit bottom of the stack.
+enum { MATCH_CACHE_MAX = 64 };
+struct match_set {
+  char *pattern;
+  int *entries;
+  int entries_sz;
+};
+int match_cache_sz;
+struct match_set match_cache[MATCH_CACHE_MAX];
+
+bool pattern_extends(const char *pattern, const char *prefix) {
+  int len = strlen(prefix);
+  return strncmp(pattern, prefix, len) == 0 &&
+         (len == 0 || prefix[len - 1] != '$');
+}
+
+void match_cache_pop(void) {
+  struct match_set *m = &match_cache[--match_cache_sz];
+  free(m->pattern);
+  free(m->entries);
+}
+
+void match_cache_clear(void) {
+  while (match_cache_sz > 0) match_cache_pop();
+}
+
+// The matcher threads split the candidates into equal slices and keep the
+// best rows of their slice in their own heap, the main thread merges the heaps
+// once all of them are done. The main thread keeps reading the input while the
+// threads scan. A new pattern cancels the pass in progress: the threads check
+// the cancel flag every MATCH_CANCEL_STRIDE candidates. The last thread to
+// finish a pass that wasn't cancelled writes a byte into done_fd. The
+// survivors of the pass go into the match cache; each thread writes them at
+// the start of its slice and the merge compacts them.
+enum { MATCH_CANCEL_STRIDE = 4096 };
+struct match_thread {
+  pthread_t thread;
+  struct match heap[MATCHES_MAX];
+  int heap_sz;
+  int matched;
+  int survivors_sz;
+};
+
+struct {
+  struct match_thread threads[CRAWL_THREADS_MAX];
+  int threads_sz;
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  int pass;
+  int running;
+  int cancel;
+  int done_fd[2];
+
+  // The pass, set up by the main thread before it starts it.
+  bool active;
+  char words[32][256];
+  int lens[32];
+  int words_cnt;
+  bool exact_first, exact_last;
+  int rows;
+  const int *candidates;
+  int candidates_sz;
+  char *pattern;
+  int *survivors;
+} matcher;
+
+int matches_count;
+int matched_count;
+int selection;
+int first_match;
+
+void match_scan(struct match_thread *t, int lo, int hi) {
+  t->heap_sz = 0;
+  t->matched = 0;
+  t->survivors_sz = 0;
+  for (int k = lo; k < hi; ++k) {
+    if ((k - lo) % MATCH_CANCEL_STRIDE == 0 &&
+        __atomic_load_n(&matcher.cancel, __ATOMIC_RELAXED)) {
+      return;
+    }
+    int i = matcher.candidates != NULL ? matcher.candidates[k] : k;
+    struct match m = {0, i};
+    if (!score_entry(i, matcher.words, matcher.lens,
+                     matcher.words_cnt, matcher.exact_first,
+                     matcher.exact_last, &m.score)) {
+      continue;
+    }
+    if (entry_boost != NULL) m.score += entry_boost[i];
+    t->matched += 1;
+    if (matcher.survivors != NULL) {
+      matcher.survivors[lo + t->survivors_sz++] = i;
+    }
+    heap_add(t->heap, &t->heap_sz, &m, matcher.rows);
+  }
+}
+
+void *match_main(void *arg) {
+  struct match_thread *t = arg;
+  int self = t - matcher.threads;
+  int seen = 0;
+  HANDLE_CASE(pthread_mutex_lock(&matcher.mutex) != 0);
+  while (true) {
+    while (matcher.pass == seen) {
+      HANDLE_CASE(pthread_cond_wait(&matcher.start_cond, &matcher.mutex) != 0);
+    }
+    seen = matcher.pass;
+    HANDLE_CASE(pthread_mutex_unlock(&matcher.mutex) != 0);
+    long long sz = matcher.candidates_sz;
+    match_scan(t, sz * self / matcher.threads_sz,
+               sz * (self + 1) / matcher.threads_sz);
+    HANDLE_CASE(pthread_mutex_lock(&matcher.mutex) != 0);
+    if (--matcher.running == 0) {
+      HANDLE_CASE(pthread_cond_broadcast(&matcher.done_cond) != 0);
+      if (!matcher.cancel) HANDLE_CASE(write(matcher.done_fd[1], "", 1) != 1);
+    }
+  }
+  return NULL;
+}
+
+// match_init starts the matcher threads. It must come after setup_fd because
+// that expects the lowest fds to be free.
+void match_init(int threads_sz) {
+  matcher.threads_sz = threads_sz;
+  HANDLE_CASE(pthread_mutex_init(&matcher.mutex, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&matcher.start_cond, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&matcher.done_cond, NULL) != 0);
+  HANDLE_CASE(pipe2(matcher.done_fd, O_CLOEXEC | O_NONBLOCK) != 0);
+  for (int i = 0; i < threads_sz; ++i) {
+    struct match_thread *t = &matcher.threads[i];
+    HANDLE_CASE(pthread_create(&t->thread, NULL, match_main, t) != 0);
+  }
+}
+
+// match_start starts a pass over the candidates of the pattern.
+void match_start(const char *pattern) {
+  while (match_cache_sz > 0 &&
+         !pattern_extends(pattern, match_cache[match_cache_sz - 1].pattern)) {
+    match_cache_pop();
+  }
+  const struct match_set *top = NULL;
+  if (match_cache_sz > 0) top = &match_cache[match_cache_sz - 1];
+  matcher.candidates = top != NULL ? top->entries : NULL;
+  matcher.candidates_sz = top != NULL ? top->entries_sz : entries_sz;
+  const char *full_pattern = pattern;
+
+  matcher.exact_first = false;
+  matcher.exact_last = false;
+  if (pattern[0] == '^') {
+    matcher.exact_first = true;
+    pattern += 1;
+  }
+  int patlen = strlen(pattern);
+  if (patlen > 0 && pattern[patlen - 1] == '$') {
+    matcher.exact_last = true;
+  }
+
+  char (*words)[256] = matcher.words;
+  int *lens = matcher.lens;
+  int words_cnt = 0;
+  int offset = 0;
+  while (words_cnt < 32) {
+    int new_offset = 0;
+    const char *s = pattern + offset;
+    if (sscanf(s, "%255s%n", words[words_cnt], &new_offset) != 1) break;
+    offset += new_offset;
+    char *w = words[words_cnt];
+    for (char *p = w; *p != 0; ++p) *p = tolower_table[(unsigned char)*p];
+    lens[words_cnt] = strlen(w);
+    words_cnt += 1;
+  }
+
+  if (words_cnt > 0 && matcher.exact_last) {
+    words[words_cnt - 1][--lens[words_cnt - 1]] = 0;
+  }
+  matcher.words_cnt = words_cnt;
+
+  if (top == NULL && trigrams.offs != NULL) {
+    if (trigram_cand_cap < entries_sz) {
+      free(trigram_cand);
+      trigram_cand_cap = entries_sz;
+      trigram_cand = malloc(trigram_cand_cap * sizeof(trigram_cand[0]) + 1);
+      HANDLE_CASE(trigram_cand == NULL);
+    }
+    int n = trigram_candidates(words, lens, words_cnt, trigram_cand);
+    if (n != -1) {
+      matcher.candidates = trigram_cand;
+      matcher.candidates_sz = n;
+    }
+  }
+  if (full_pattern[0] != 0 && match_cache_sz < MATCH_CACHE_MAX &&
+      (top == NULL || !streq(top->pattern, full_pattern))) {
+    int sz = matcher.candidates_sz;
+    matcher.survivors = malloc(sz * sizeof(matcher.survivors[0]) + 1);
+    HANDLE_CASE(matcher.survivors == NULL);
+    HANDLE_CASE((matcher.pattern = strdup(full_pattern)) == NULL);
+  }
+
+  matcher.rows = screen_rows();
+
+  HANDLE_CASE(pthread_mutex_lock(&matcher.mutex) != 0);
+  __atomic_store_n(&matcher.cancel, 0, __ATOMIC_RELAXED);
+  matcher.running = matcher.threads_sz;
+  matcher.pass++;
+  matcher.active = true;
+  HANDLE_CASE(pthread_cond_broadcast(&matcher.start_cond) != 0);
+  HANDLE_CASE(pthread_mutex_unlock(&matcher.mutex) != 0);
+}
+
+// match_wait waits until the threads are done with the pass, cancelling it
+// if cancel is set.
+void match_wait(bool cancel) {
+  HANDLE_CASE(pthread_mutex_lock(&matcher.mutex) != 0);
+  if (cancel) __atomic_store_n(&matcher.cancel, 1, __ATOMIC_RELAXED);
+  while (matcher.running > 0) {
+    HANDLE_CASE(pthread_cond_wait(&matcher.done_cond, &matcher.mutex) != 0);
+  }
+  HANDLE_CASE(pthread_mutex_unlock(&matcher.mutex) != 0);
+  char ch;
+  while (read(matcher.done_fd[0], &ch, 1) == 1) continue;
+  HANDLE_CASE(errno != EAGAIN);
+}
+
+void match_cancel(void) {
+  if (!matcher.active) return;
+  match_wait(true);
+  free(matcher.pattern);
+  free(matcher.survivors);
+  matcher.pattern = NULL;
+  matcher.survivors = NULL;
+  matcher.active = false;
+}
+
+// The content search looks for the pattern in the contents of the entries'
+// files instead of their names, ^G switches to it and back. The pattern is a
+// literal string, it ignores case unless it has an uppercase letter. The
+// grep threads take the entries in groups of GREP_FILES, map the files and
+// skip the ones with a NUL byte in their first GREP_BINARY_CHECK bytes as
+// binary. The mapped files are searched in GREP_CHUNK sized pieces copied
+// into a padded buffer, lowercased if needed, with the substring kernel. Only
+// the first hit of a line counts and the search stops at GREP_HITS_MAX hits.
+// The threads write 'b' into fd when there are new hits, unless it is already
+// notified, and 'd' when the pass is done. The main loop then sorts the hits
+// by entry and line, hits[0..shown) are the sorted ones. While the crawl is
+// streaming, new batches wait for the pass like for the matcher and a pass
+// over the entries appended since is resumed.
+enum { GREP_FILES = 16, GREP_CHUNK = 64 * 1024, GREP_BINARY_CHECK = 1024 };
+enum { GREP_HITS_MAX = 10000, GREP_TEXT_MAX = 256 };
+
+struct grep_hit {
+  int entry;
+  int line;
+  char text[GREP_TEXT_MAX];
+};
+
+struct {
+  pthread_t threads[CRAWL_THREADS_MAX];
+  int threads_sz;
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  int pass;
+  int running;
+  int cancel;
+  int full;
+  int fd[2];
+  bool notified;
+  bool active;
+  int next, end;
+  int searched;
+  char query[256];
+  int query_len;
+  bool fold;
+  struct grep_hit *hits;
+  int hits_sz;
+  int shown;
+} grep;
+
+bool content_mode;
+
+// grep_add adds a hit in the line of text. Returns false once there are
+// enough hits.
+bool grep_add(int entry, int line, const char *text, int len) {
+  while (len > 0 && (text[0] == ' ' || text[0] == '\t')) {
+    text++;
+    len--;
+  }
+  if (len >= GREP_TEXT_MAX) len = GREP_TEXT_MAX - 1;
+  HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+  bool ok = grep.hits_sz < GREP_HITS_MAX;
+  if (ok) {
+    struct grep_hit *h = &grep.hits[grep.hits_sz++];
+    h->entry = entry;
+    h->line = line;
+    for (int i = 0; i < len; ++i) {
+      unsigned char ch = text[i];
+      h->text[i] = ch < 32 || ch == 127 ? ' ' : ch;
+    }
+    h->text[len] = 0;
+    if (!grep.notified) HANDLE_CASE(write(grep.fd[1], "b", 1) != 1);
+    grep.notified = true;
+  } else {
+    __atomic_store_n(&grep.full, 1, __ATOMIC_RELAXED);
+  }
+  HANDLE_CASE(pthread_mutex_unlock(&grep.mutex) != 0);
+  return ok;
+}
+
+bool grep_stopped(void) {
+  return __atomic_load_n(&grep.cancel, __ATOMIC_RELAXED) ||
+         __atomic_load_n(&grep.full, __ATOMIC_RELAXED);
+}
+
+// grep_file searches the file of the entry. buf has room for a chunk, the
+// overlap with the next one and the padding.
+void grep_file(int entry, char *buf) {
+  int fd = open(names + entry_off[entry], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) return;
+  struct stat s;
+  const char *p = MAP_FAILED;
+  if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode) && s.st_size > 0) {
+    p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  HANDLE_CASE(close(fd) != 0);
+  if (p == MAP_FAILED) return;
+  size_t size = s.st_size;
+  const char *q = grep.query;
+  int qlen = grep.query_len;
+  if (memchr(p, 0, size < GREP_BINARY_CHECK ? size : GREP_BINARY_CHECK)) {
+    size = 0;
+  }
+  int line = 1;
+  size_t pos = 0, counted = 0;
+  while (pos < size && !grep_stopped()) {
+    size_t n = size - pos < GREP_CHUNK ? size - pos : GREP_CHUNK;
+    size_t m = size - pos < n + qlen - 1 ? size - pos : n + qlen - 1;
+    if (grep.fold) {
+      for (size_t i = 0; i < m; ++i) {
+        buf[i] = tolower_table[(unsigned char)p[pos + i]];
+      }
+    } else {
+      memcpy(buf, p + pos, m);
+    }
+    memset(buf + m, 0, SUBSTR_PAD);
+    const char *hit = substr_find(buf, m, q, qlen);
+    if (hit == NULL || (size_t)(hit - buf) >= n) {
+      pos += n;
+      continue;
+    }
+    size_t at = pos + (hit - buf);
+    for (const char *nl = p + counted;
+         (nl = memchr(nl, '\n', p + at - nl)) != NULL; ++nl) {
+      line++;
+    }
+    counted = at;
+    const char *start = memrchr(p, '\n', at);
+    start = start == NULL ? p : start + 1;
+    const char *end = memchr(p + at, '\n', size - at);
+    if (end == NULL) end = p + size;
+    if (!grep_add(entry, line, start, end - start)) break;
+    pos = end - p + 1;
+  }
+  HANDLE_CASE(munmap((void *)p, s.st_size) != 0);
+}
+
+void *grep_main(void *arg) {
+  (void)arg;
+  char *buf = malloc(GREP_CHUNK + sizeof(grep.query) + SUBSTR_PAD);
+  HANDLE_CASE(buf == NULL);
+  int seen = 0;
+  HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+  while (true) {
+    while (grep.pass == seen) {
+      HANDLE_CASE(pthread_cond_wait(&grep.start_cond, &grep.mutex) != 0);
+    }
+    seen = grep.pass;
+    HANDLE_CASE(pthread_mutex_unlock(&grep.mutex) != 0);
+    while (!grep_stopped()) {
+      int i = __atomic_fetch_add(&grep.next, GREP_FILES, __ATOMIC_RELAXED);
+      if (i >= grep.end) break;
+      int end = i + GREP_FILES < grep.end ? i + GREP_FILES : grep.end;
+      int first = i;
+      for (; i < end && !grep_stopped(); ++i) grep_file(i, buf);
+      __atomic_add_fetch(&grep.searched, i - first, __ATOMIC_RELAXED);
+    }
+    HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+    if (--grep.running == 0) {
+      HANDLE_CASE(pthread_cond_broadcast(&grep.done_cond) != 0);
+      if (!grep.cancel) HANDLE_CASE(write(grep.fd[1], "d", 1) != 1);
+    }
+  }
+  return NULL;
+}
+
+// grep_init starts the grep threads. It must come after setup_fd because
+// that expects the lowest fds to be free.
+void grep_init(int threads_sz) {
+  grep.threads_sz = threads_sz;
+  grep.hits = malloc(GREP_HITS_MAX * sizeof(grep.hits[0]));
+  HANDLE_CASE(grep.hits == NULL);
+  HANDLE_CASE(pthread_mutex_init(&grep.mutex, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&grep.start_cond, NULL) != 0);
+  HANDLE_CASE(pthread_cond_init(&grep.done_cond, NULL) != 0);
+  HANDLE_CASE(pipe2(grep.fd, O_CLOEXEC | O_NONBLOCK) != 0);
+  for (int i = 0; i < threads_sz; ++i) {
+    HANDLE_CASE(pthread_create(&grep.threads[i], NULL, grep_main, NULL) != 0);
+  }
+}
+
+// grep_run starts a pass over the entries from next on.
+void grep_run(int next) {
+  HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+  grep.cancel = 0;
+  grep.next = next;
+  grep.end = entries_sz;
+  grep.running = grep.threads_sz;
+  grep.pass++;
+  grep.active = true;
+  HANDLE_CASE(pthread_cond_broadcast(&grep.start_cond) != 0);
+  HANDLE_CASE(pthread_mutex_unlock(&grep.mutex) != 0);
+}
+
+void grep_cancel(void) {
+  if (!grep.active) return;
+  HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+  __atomic_store_n(&grep.cancel, 1, __ATOMIC_RELAXED);
+  while (grep.running > 0) {
+    HANDLE_CASE(pthread_cond_wait(&grep.done_cond, &grep.mutex) != 0);
+  }
+  grep.notified = false;
+  HANDLE_CASE(pthread_mutex_unlock(&grep.mutex) != 0);
+  char ch;
+  while (read(grep.fd[0], &ch, 1) == 1) continue;
+  HANDLE_CASE(errno != EAGAIN);
+  grep.active = false;
+}
+
+// grep_start starts a search for the pattern, dropping the previous hits.
+void grep_start(const char *pattern) {
+  grep_cancel();
+  grep.hits_sz = 0;
+  grep.shown = 0;
+  grep.full = 0;
+  grep.searched = 0;
+  grep.query_len = snprintf(grep.query, sizeof(grep.query), "%s", pattern);
+  if (grep.query_len >= (int)sizeof(grep.query)) {
+    grep.query_len = sizeof(grep.query) - 1;
+  }
+  grep.fold = true;
+  for (int i = 0; i < grep.query_len; ++i) {
+    grep.fold = grep.fold && !isupper_table[(unsigned char)grep.query[i]];
+  }
+  if (grep.query_len > 0) grep_run(0);
+}
+
+// grep_resume searches the entries appended since the last pass.
+void grep_resume(void) {
+  if (grep.query_len > 0 && !grep.full && grep.end < entries_sz) {
+    grep_run(grep.end);
+  }
+}
+
+int grep_hit_cmp(const void *a, const void *b) {
+  const struct grep_hit *x = a, *y = b;
+  if (x->entry != y->entry) return x->entry < y->entry ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// grep_take sorts the new hits for showing them. Returns true if the pass is
+// done.
+bool grep_take(void) {
+  char ch[8];
+  int rby = read(grep.fd[0], ch, sizeof(ch));
+  HANDLE_CASE(rby <= 0);
+  bool done = memchr(ch, 'd', rby) != NULL;
+  HANDLE_CASE(pthread_mutex_lock(&grep.mutex) != 0);
+  qsort(grep.hits, grep.hits_sz, sizeof(grep.hits[0]), grep_hit_cmp);
+  grep.shown = grep.hits_sz;
+  grep.notified = false;
+  HANDLE_CASE(pthread_mutex_unlock(&grep.mutex) != 0);
+  if (done) grep.active = false;
+  return done;
+}
+
+// The screen model holds the lines below the prompt as they are on the
+// terminal: line i is screen_text[screen_off[i]..screen_off[i + 1]). A redraw
+// composes the new lines the same way and rewrites only the ones that differ,
+// addressing them absolutely since the prompt is on the first row. It's all
+// sent in one write. With -d the bottom row shows how many bytes the redraws
+// of the last key took.
+enum { SCREEN_LINES_MAX = MATCHES_MAX + 2 };
+int screen_sz;
+int screen_off[SCREEN_LINES_MAX + 1];
+char screen_text[OUTBUF_MAX];
+int next_sz;
+int next_off[SCREEN_LINES_MAX + 1];
+char next_text[OUTBUF_MAX];
+bool debug_redraw;
+int redraw_bytes;
+
+void next_line(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void next_line(const char *fmt, ...) {
+  int off = next_off[next_sz];
+  va_list ap;
+  va_start(ap, fmt);
+  off += vsnprintf(next_text + off, OUTBUF_MAX - off, fmt, ap);
+  va_end(ap);
+  HANDLE_CASE(off >= OUTBUF_MAX);
+  next_off[++next_sz] = off;
+}
+
+// screen_same returns whether line i of the screen stays the same.
+bool screen_same(int i) {
+  if (i >= screen_sz || i >= next_sz) return false;
+  int len = next_off[i + 1] - next_off[i];
+  return len == screen_off[i + 1] - screen_off[i] &&
+         memcmp(next_text + next_off[i], screen_text + screen_off[i], len) == 0;
+}
+
+// render_hits composes the lines of the content search's hits.
+void render_hits(void) {
+  int rows = grep.shown < screen_rows() ? grep.shown : screen_rows();
+  for (int r = 0; r < rows; ++r) {
+    const struct grep_hit *h = &grep.hits[r];
+    const char *mark = r == selection ? " -> " : "    ";
+    char line[4 * GREP_TEXT_MAX];
+    snprintf(line, sizeof(line), "%s%s:%d: %s", mark,
+             names + entry_off[h->entry], h->line, h->text);
+    next_line("%.*s", term_width - 1, line);
+  }
+  if (grep.shown > rows) next_line("    ... and others ...");
+  int searched = __atomic_load_n(&grep.searched, __ATOMIC_RELAXED);
+  if (grep.full) {
+    next_line("    stopped at %d hits", GREP_HITS_MAX);
+  } else if (grep.active) {
+    next_line("    %d of %d files searched", searched, grep.end);
+  }
+}
+
+void render_matches(void) {
+  next_sz = 0;
+  for (int r = 0; r < heap_sz && !content_mode; ++r) {
+    const char *name = names + entry_off[heap[r].entry];
+    int len = entry_len[heap[r].entry];
+    const char *mark = r == selection ? " -> " : "    ";
+    if (len + 6 >= term_width) {
+      next_line("%s...%s", mark, name + len - term_width + 8);
+    } else {
+      next_line("%s%s", mark, name);
+    }
+  }
+  if (content_mode) {
+    render_hits();
+  } else if (matched_count > heap_sz) {
+    next_line("    ... and others ...");
+  }
+  int pruned = __atomic_load_n(&crawl.pruned, __ATOMIC_RELAXED);
+  if (stream.active && pruned > 0) {
+    next_line("    %d files indexed, %d ignored entries pruned", entries_sz,
+              pruned);
+  } else if (stream.active) {
+    next_line("    %d files indexed", entries_sz);
+  }
+
+  char *buf = output_buffer;
+  memcpy(buf, "\e[s", 3);
+  buf += 3;
+  for (int i = 0; i < next_sz || i < screen_sz; ++i) {
+    if (screen_same(i)) continue;
+    int len = i < next_sz ? next_off[i + 1] - next_off[i] : 0;
+    buf += sprintf(buf, "\e[%d;1H", i + 2);
+    memcpy(buf, next_text + next_off[i], len);
+    buf += len;
+    memcpy(buf, "\e[K", 3);
+    buf += 3;
+  }
+  screen_sz = next_sz;
+  memcpy(screen_off, next_off, (next_sz + 1) * sizeof(next_off[0]));
+  memcpy(screen_text, next_text, next_off[next_sz]);
+  if (buf == output_buffer + 3) return;
+
+  redraw_bytes += buf - output_buffer + 3;
+  if (debug_redraw) {
+    buf += sprintf(buf, "\e[%d;1H%d bytes redrawn for the last key",
+                   term_height, redraw_bytes);
+    if (trigrams.offs != NULL) {
+      size_t sz = (TRIGRAM_IDS + 1) * 4 + (size_t)trigrams.offs[TRIGRAM_IDS];
+      buf += sprintf(buf, ", trigram index %.1f MiB, %d candidates",
+                     sz / 1048576.0, matcher.candidates_sz);
+    }
+    memcpy(buf, "\e[K", 3);
+    buf += 3;
+  }
+  memcpy(buf, "\e[u", 3);
+  buf += 3;
+  swrite(1, output_buffer, buf - output_buffer);
+}
+
+// match_finish merges the results of the finished pass and shows them.
+void match_finish(void) {
+  match_wait(false);
+  matcher.active = false;
+  heap_sz = 0;
+  matched_count = 0;
+  int survivors_sz = 0;
+  for (int i = 0; i < matcher.threads_sz; ++i) {
+    const struct match_thread *t = &matcher.threads[i];
+    for (int j = 0; j < t->heap_sz; ++j) {
+      heap_add(heap, &heap_sz, &t->heap[j], matcher.rows);
+    }
+    matched_count += t->matched;
+    if (matcher.survivors != NULL) {
+      long long lo = (long long)matcher.candidates_sz * i / matcher.threads_sz;
+      memmove(matcher.survivors + survivors_sz, matcher.survivors + lo,
+              t->survivors_sz * sizeof(matcher.survivors[0]));
+      survivors_sz += t->survivors_sz;
+    }
+  }
+  if (matcher.survivors != NULL) {
+    struct match_set *m = &match_cache[match_cache_sz++];
+    m->pattern = matcher.pattern;
+    m->entries = matcher.survivors;
+    m->entries_sz = survivors_sz;
+    matcher.pattern = NULL;
+    matcher.survivors = NULL;
+  }
+  qsort(heap, heap_sz, sizeof(heap[0]), match_cmp);
+
+  matches_count = heap_sz;
+  if (selection >= matches_count) selection = matches_count - 1;
+  if (selection < 0) selection = 0;
+  first_match = matches_count > 0 ? heap[selection].entry : -1;
+  render_matches();
+}
+
+void noop(char *s) { (void)s; }
+
+const char *prompt(void) {
+  return content_mode ? "content: " : "fuzzy name: ";
+}
+
+// search_cancel stops the pass of the current mode.
+void search_cancel(void) {
+  match_cancel();
+  grep_cancel();
+}
+
+// search_start starts a pass of the current mode over all the entries.
+void search_start(void) {
+  if (content_mode) {
+    grep_start(rl_line_buffer);
+    render_matches();
+  } else {
+    match_start(rl_line_buffer);
+  }
+}
+
+// The keystroke benchmark replays the script of -k without a terminal,
+// KEYS_RUNS times, and times each key from its arrival to the end of its
+// redraw. The redraws go to /dev/null. The script's characters type
+// themselves except ^H (backspace), ^N and ^P (down and up) and ^[ (escape,
+// clears the pattern). The entries are the hierarchy, the argv or the stdin
+// ones, or with -m n generated paths. The history isn't loaded and the prefix
+// cache is cleared before each run so that every run does the same work.
+enum { KEYS_RUNS = 20, KEYS_MAX = 256, PATTERN_MAX = 256 };
+const char *keys_script;
+int keys_generate;
+
+int double_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// percentile returns the q permille nearest rank of the n sorted values.
+double percentile(const double *v, int n, int q) {
+  int i = ((long long)q * n + 999) / 1000 - 1;
+  return v[i < 0 ? 0 : i];
+}
+
+// keys_parse turns the script into keys. Returns their count.
+int keys_parse(const char *script, char *keys) {
+  int n = 0;
+  for (const char *p = script; *p != 0 && n < KEYS_MAX; ++p) {
+    if (p[0] == '^' && p[1] != 0) {
+      p++;
+      keys[n++] = *p == '[' ? 27 : *p & 31;
+    } else {
+      keys[n++] = *p;
+    }
+  }
+  return n;
+}
+
+// keys_entries makes the entries of the benchmark and prints the times it
+// took.
+void keys_entries(char **args, int args_sz, bool from_stdin) {
+  double start = now();
+  if (keys_generate > 0) {
+    struct crawl_file *paths = malloc(keys_generate * sizeof(paths[0]));
+    char *corpus = malloc((size_t)keys_generate * SYNTHETIC_LEN);
+    HANDLE_CASE(paths == NULL || corpus == NULL);
+    uint32_t rnd = 1;
+    size_t off = 0;
+    for (int i = 0; i < keys_generate; ++i) {
+      paths[i].path = corpus + off;
+      paths[i].len = synthetic_path(corpus + off, &rnd);
+      off += paths[i].len + 1;
+    }
+    double generated = now();
+    paths_sort(paths, keys_generate, crawl_threads);
+    double sorted = now();
+    entries_build(paths, keys_generate);
+    trigram_entries();
+    printf("generate %.3f s, sort %.3f s, entries %.3f s", generated - start,
+           sorted - generated, now() - sorted - trigrams.build_time);
+    free(paths);
+    free(corpus);
+  } else if (from_stdin) {
+    HANDLE_CASE((stdin_fd = dup(0)) == -1);
+    stream_start(stdin_main);
+    char ch = 0;
+    while (ch != 'd') HANDLE_CASE(read(stream.fd[0], &ch, 1) != 1);
+    double done = now();
+    stream_done();
+    printf("read and sort %.3f s, entries %.3f s", done - start,
+           now() - done - trigrams.build_time);
+  } else if (args_sz > 0) {
+    struct crawl_file *paths = malloc(args_sz * sizeof(paths[0]));
+    HANDLE_CASE(paths == NULL);
+    for (int i = 0; i < args_sz; ++i) {
+      paths[i].path = args[i];
+      paths[i].len = strlen(args[i]);
+    }
+    paths_sort(paths, args_sz, crawl_threads);
+    double sorted = now();
+    entries_build(paths, args_sz);
+    trigram_entries();
+    printf("sort %.3f s, entries %.3f s", sorted - start,
+           now() - sorted - trigrams.build_time);
+    free(paths);
+  } else {
+    struct crawl_dir root = {-1, curpath, curpath_sz, NULL, true};
+    struct crawl_result result;
+    crawl_run(crawl_threads, &root, 1, &result);
+    double crawled = now();
+    paths_sort(result.files, result.files_sz, crawl_threads);
+    double sorted = now();
+    printf("crawl %.3f s, sort %.3f s", crawled - start, sorted - crawled);
+    index_usable = use_index && index_init();
+    if (index_usable &&
+        index_write(result.files, result.files_sz, result.dirs,
+                    result.dirs_sz)) {
+      double written = now();
+      HANDLE_CASE(!index_load(&index_cur));
+      index_entries();
+      printf(", index write %.3f s, index load %.3f s", written - sorted,
+             now() - written);
+    } else {
+      entries_build(result.files, result.files_sz);
+      trigram_entries();
+      printf(", entries %.3f s", now() - sorted - trigrams.build_time);
+    }
+    crawl_result_free(&result);
+  }
+  if (trigrams.build_time > 0) {
+    printf(", trigrams %.3f s", trigrams.build_time);
+  }
+  printf(", %d entries\n", entries_sz);
+}
+
+// keys_benchmark replays the script and prints the latencies of each key and
+// of all of them.
+void keys_benchmark(char **args, int args_sz, bool from_stdin) {
+  static double lat[KEYS_MAX][KEYS_RUNS];
+  static double all[KEYS_MAX * KEYS_RUNS];
+  static char patterns[KEYS_MAX][PATTERN_MAX];
+  static int matched[KEYS_MAX], bytes[KEYS_MAX];
+  char keys[KEYS_MAX];
+  int keys_sz = keys_parse(keys_script, keys);
+  keys_entries(args, args_sz, from_stdin);
+
+  // A fixed screen so the redraws don't depend on the terminal.
+  term_width = 120;
+  term_height = 40;
+  match_init(crawl_threads);
+  HANDLE_CASE(fflush(stdout) != 0);
+  int out = dup(1);
+  int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  HANDLE_CASE(out == -1 || null == -1 || dup2(null, 1) != 1);
+
+  for (int run = 0; run < KEYS_RUNS; ++run) {
+    char pattern[PATTERN_MAX] = {};
+    int len = 0;
+    match_cache_clear();
+    screen_sz = 0;
+    selection = 0;
+    match_start(pattern);
+    match_finish();
+    for (int k = 0; k < keys_sz; ++k) {
+      double start = now();
+      redraw_bytes = 0;
+      char ch = keys[k];
+      bool changed = true;
+      if (ch == 8 || ch == 127) {
+        if (len > 0) pattern[--len] = 0;
+      } else if (ch == 27) {
+        len = 0;
+        pattern[0] = 0;
+      } else if (ch == 14) {
+        if (matches_count > 0) selection = (selection + 1) % matches_count;
+        changed = false;
+      } else if (ch == 16) {
+        if (matches_count > 0) {
+          selection = (selection + matches_count - 1) % matches_count;
+        }
+        changed = false;
+      } else if (len + 1 < PATTERN_MAX) {
+        pattern[len++] = ch;
+        pattern[len] = 0;
+      }
+      if (changed) {
+        match_cancel();
+        match_start(pattern);
+        match_finish();
+      } else {
+        first_match = matches_count > 0 ? heap[selection].entry : -1;
+        render_matches();
+      }
+      lat[k][run] = now() - start;
+      all[run * keys_sz + k] = lat[k][run];
+      memcpy(patterns[k], pattern, len + 1);
+      matched[k] = matched_count;
+      bytes[k] = redraw_bytes;
+    }
+  }
+
+  HANDLE_CASE(dup2(out, 1) != 1);
+  HANDLE_CASE(close(out) != 0 || close(null) != 0);
+  printf("%-4s %-24s %9s %7s %9s %9s\n", "key", "pattern", "matches", "bytes",
+         "p50", "p99");
+  for (int k = 0; k < keys_sz; ++k) {
+    char name[4] = {keys[k]};
+    if ((unsigned char)keys[k] < 32) {
+      snprintf(name, sizeof(name), "^%c", keys[k] == 27 ? '[' : keys[k] + 64);
+    }
+    qsort(lat[k], KEYS_RUNS, sizeof(lat[k][0]), double_cmp);
+    printf("%-4s %-24.24s %9d %7d %7.3fms %7.3fms\n", name, patterns[k],
+           matched[k], bytes[k], percentile(lat[k], KEYS_RUNS, 500) * 1e3,
+           percentile(lat[k], KEYS_RUNS, 990) * 1e3);
+  }
+  int n = keys_sz * KEYS_RUNS;
+  if (n == 0) return;
+  qsort(all, n, sizeof(all[0]), double_cmp);
+  printf("%d keys in %d runs: p50 %.3fms, p99 %.3fms, max %.3fms\n", keys_sz,
+         KEYS_RUNS, percentile(all, n, 500) * 1e3,
+         percentile(all, n, 990) * 1e3, all[n - 1] * 1e3);
+}
+
+int main(int argc, char **argv) {
+  for (int fd = 3; fd < 16; ++fd) close(fd);
+
+  curpath[0] = '.';
+
+  crawl_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool benchmark = false;
+  bool substr_bench = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "bdgIj:k:m:nstu:")) != -1) {
+    if (opt == 'u') {
+      int n = atoi(optarg);
+      for (int i = 0; i < n; ++i) {
+        curpath[curpath_sz++] = '.';
+        curpath[curpath_sz++] = '.';
+        curpath[curpath_sz++] = '/';
+      }
+    } else if (opt == 'j') {
+      crawl_threads = atoi(optarg);
+    } else if (opt == 'b') {
+      benchmark = true;
+    } else if (opt == 'k') {
+      keys_script = optarg;
+    } else if (opt == 'm') {
+      keys_generate = atoi(optarg);
+    } else if (opt == 'n') {
+      use_index = false;
+    } else if (opt == 'd') {
+      debug_redraw = true;
+    } else if (opt == 'g') {
+      content_mode = true;
+    } else if (opt == 'I') {
+      use_ignore = false;
+    } else if (opt == 's') {
+      substr_bench = true;
+    } else if (opt == 't') {
+      use_trigrams = true;
+    } else {
+      puts("file-selector [-bdgInst] [-j n] [-k keys [-m n]] [-u n] "
+           "[- | entries...]");
+      puts("");
+      puts("-b: benchmark the directory crawl with 1 to -j threads");
+      puts("-d: show the bytes of the redraws of the last key");
+      puts("-g: search the contents of the files, ^G switches the modes");
+      puts("-I: don't skip the entries in .gitignore and .ignore files");
+      puts("-j n: crawl the directories and match on n threads");
+      puts("-k keys: benchmark the latency of the keys, ^H ^N ^P ^[ are "
+           "backspace,");
+      puts("         down, up and escape");
+      puts("-m n: with -k, match n generated paths");
+      puts("-n: don't use the index in ~/.cache/file_selector");
+      puts("-s: benchmark the substring kernels against strstr");
+      puts("-t: use a trigram index, words of 3+ characters match exactly");
+      puts("-u n: go up n levels in the directory hierarchy");
+      puts("-: read the entries from stdin, one per line or NUL separated");
+      exit(1);
+    }
+  }
+  if (crawl_threads < 1) crawl_threads = 1;
+  if (crawl_threads > CRAWL_THREADS_MAX) crawl_threads = CRAWL_THREADS_MAX;
+  trigram_class_calc();
+  if (benchmark) {
+    tolower_table_calc();
+    crawl_benchmark();
+    if (use_trigrams) trigram_benchmark();
+    exit(0);
+  }
+  substr_init();
+  if (substr_bench) {
+    substr_benchmark();
+    exit(0);
+  }
+
+  // With - the entries come from stdin and the keys from the terminal.
+  bool from_stdin = optind + 1 == argc && streq(argv[optind], "-");
+  if (keys_script != NULL) {
+    tolower_table_calc();
+    keys_benchmark(argv + optind, argc - optind, from_stdin);
+    exit(0);
+  }
+  if (from_stdin) {
+    HANDLE_CASE((stdin_fd = fcntl(0, F_DUPFD_CLOEXEC, 16)) == -1);
+    HANDLE_CASE(close(0) != 0);
+    HANDLE_CASE(open("/dev/tty", O_RDWR) != 0);
+  }
+
+  // Swap stdout with stderr so readline won't spam stdout where the
+  // result will go.
+  swap_fd(1, 2);
+  swrite(1, "\e[?1049h", 8);
+  swrite(1, "\e[H\e[2J", 7);
+
+  get_term_dimensions();
+  tolower_table_calc();
+
+  history_load();
+  bool crawling = false;
+  if (optind == argc) {
+    crawling = !read_index();
+  } else if (!from_stdin) {
+    int paths_sz = argc - optind;
+    struct crawl_file *paths = malloc(paths_sz * sizeof(paths[0]));
+    HANDLE_CASE(paths == NULL);
+    for (int i = 0; i < paths_sz; ++i) {
+      paths[i].path = argv[optind + i];
+      paths[i].len = strlen(argv[optind + i]);
+    }
+    paths_sort(paths, paths_sz, crawl_threads);
+    entries_build(paths, paths_sz);
+    trigram_entries();
+    free(paths);
+  }
+
+  rl_callback_handler_install(prompt(), noop);
+  setup_fd();
+  index_refresh_start();
+  if (crawling) stream_start(stream_main);
+  if (stdin_fd != -1) stream_start(stdin_main);
+  match_init(crawl_threads);
+  grep_init(crawl_threads);
+
+  swrite(1, "\e[H\e[2J", 7);
+  search_start();
+  bool stream_pending = false;
+  double stream_due = 0;
+  while (true) {
+    struct pollfd pfds[5] = {
+        {5, POLLIN, 0},
+        {matcher.done_fd[0], POLLIN, 0},
+        {index_refresh_fd[0], POLLIN, 0},
+        {stream.active ? stream.fd[0] : -1, POLLIN, 0},
+        {grep.fd[0], POLLIN, 0},
+    };
+    // New batches wait for the pass in progress and for the interval.
+    bool busy = matcher.active || grep.active;
+    int timeout = -1;
+    if (stream_pending && !busy) {
+      double wait = stream_due - now();
+      timeout = wait > 0 ? wait * 1000 + 1 : 0;
+    }
+    HANDLE_CASE(poll(pfds, 5, timeout) == -1);
+    if (pfds[1].revents != 0) {
+      match_finish();
+      continue;
+    }
+    if (pfds[4].revents != 0) {
+      grep_take();
+      if (selection >= screen_rows()) selection = screen_rows() - 1;
+      if (selection >= grep.shown) selection = grep.shown - 1;
+      if (selection < 0) selection = 0;
+      render_matches();
+      continue;
+    }
+    if (pfds[3].revents != 0) {
+      char ch[8];
+      int rby = read(stream.fd[0], ch, sizeof(ch));
+      HANDLE_CASE(rby <= 0);
+      if (memchr(ch, 'd', rby) != NULL) {
+        stream_pending = false;
+        search_cancel();
+        stream_done();
+        match_cache_clear();
+        search_start();
+      } else {
+        stream_pending = true;
+      }
+      continue;
+    }
+    if (stream_pending && !busy && now() >= stream_due) {
+      stream_pending = false;
+      stream_take();
+      match_cache_clear();
+      if (content_mode) {
+        grep_resume();
+        render_matches();
+      } else {
+        match_start(rl_line_buffer);
+      }
+      stream_due = now() + STREAM_INTERVAL;
+      continue;
+    }
+    if (pfds[2].revents != 0) {
+      bool restart = busy;
+      search_cancel();
+      if (index_refresh_done()) {
+        match_cache_clear();
+        restart = true;
+      }
+      if (restart) search_start();
+      continue;
+    }
+    if (pfds[0].revents == 0) continue;
+
+    // Handle all the input that is already there before starting a new pass
+    // so that a paste only runs one.
+    bool changed = false, moved = false;
+    redraw_bytes = 0;
+    do {
+      char ch[8] = {};
+      int rby = read(5, ch, 7);
+      HANDLE_CASE(rby == -1);
+      if (rby == 1 && ch[0] == 27 && rl_end != 0) {
+        // Escape on nonempty string: clear pattern.
+        rl_delete_text(0, rl_end);
+        // Readline hack. Not sure why is this needed.
+        rl_callback_handler_install(prompt(), noop);
+        changed = true;
+        rby = 0;
+      } else if (rby == 1 && ch[0] == 7) {
+        // Pressed ^G: switch between matching the names and the contents.
+        search_cancel();
+        content_mode = !content_mode;
+        selection = 0;
+        rl_set_prompt(prompt());
+        rl_forced_update_display();
+        changed = true;
+        rby = 0;
+      } else if (rby == 0 || (rby == 1 && ch[0] == 27)) {
+        // Escape on empty string: quit,
+        reset_fd();
+        rl_deprep_terminal();
+        swrite(1, "\e[?1049l", 8);
+        exit(1);
+      } else if (ch[0] == 13 && content_mode) {
+        // Pressed Return, print the selected hit as path:line.
+        if (changed) grep_start(rl_line_buffer);
+        while (changed && grep.active) {
+          struct pollfd pfd = {grep.fd[0], POLLIN, 0};
+          HANDLE_CASE(poll(&pfd, 1, -1) != 1);
+          grep_take();
+        }
+        int hit = selection < grep.shown ? grep.hits[selection].entry : -1;
+        int line = hit != -1 ? grep.hits[selection].line : 0;
+        reset_fd();
+        rl_deprep_terminal();
+        swrite(1, "\e[?1049l", 8);
+        if (hit == -1) exit(1);
+        history_record(names + entry_off[hit]);
+        fprintf(stderr, "%s:%d\n", names + entry_off[hit], line);
+        exit(0);
+      } else if (ch[0] == 13) {
+        // Pressed Return.
+        if (changed) {
+          match_cancel();
+          match_start(rl_line_buffer);
+        }
+        if (matcher.active) match_finish();
+        first_match = matches_count > 0 ? heap[selection].entry : -1;
+        reset_fd();
+        rl_deprep_terminal();
+        swrite(1, "\e[?1049l", 8);
+        if (first_match != -1) {
+          history_record(names + entry_off[first_match]);
+          fputs(names + entry_off[first_match], stderr);
+          fputc('\n', stderr);
+        } else {
+          exit(1);
+        }
+        exit(0);
+      } else if (ch[0] == 10 || ch[0] == 14 || streq(ch, "\e[B")) {
+        // Pressed ^J or ^N or Down.
+        if (content_mode) {
+          int rows = grep.shown < screen_rows() ? grep.shown : screen_rows();
+          if (rows > 0) selection = (selection + 1) % rows;
+        } else if (matches_count > 0) {
+          selection += 1;
+          selection %= matches_count;
+        }
+        moved = true;
+        rby = 0;
+      } else if (ch[0] == 11 || ch[0] == 16 || streq(ch, "\e[A")) {
+        // Pressed ^K or ^P or Up.
+        if (content_mode) {
+          int rows = grep.shown < screen_rows() ? grep.shown : screen_rows();
+          if (rows > 0) selection = (selection + rows - 1) % rows;
+        } else if (matches_count > 0) {
+          selection += matches_count - 1;
+          selection %= matches_count;
+        }
+        moved = true;
+        rby = 0;
+      }
+
+      for (int i = 0; i < rby; ++i) {
+        swrite(4, ch + i, 1);
+        rl_callback_read_char();
+        changed = true;
+      }
+    } while (poll(pfds, 1, 0) == 1);
 
-    for (int i = 0; i < rby; ++i) {
-      swrite(4, ch + i, 1);
-      rl_callback_read_char();
+    if (changed) {
+      search_cancel();
+      search_start();
+    } else if (moved && content_mode) {
+      render_matches();
+    } else if (moved && !matcher.active) {
+      first_match = matches_count > 0 ? heap[selection].entry : -1;
+      render_matches();
     }
-    match_pattern(rl_line_buffer);
   }
 
   return 0;
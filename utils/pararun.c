@@ -7,15 +7,26 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <openssl/evp.h>
 #include <poll.h>
+#include <sched.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 const char usage[] =
@@ -29,13 +40,104 @@ const char usage[] =
   "  -j[num]: maximum number of threads to use. defaults to 2 times the\n"
   "           number of cores the computer has.\n"
   "  -q     : omit printing the commands (omit printing the yellow text).\n"
+  "  -0     : input items are separated by nul bytes rather than newlines.\n"
+  "           each item is a single argument, spaces are not split.\n"
+  "  --sep=c: like -0 but the items are separated by the character c.\n"
+  "  -n num : pack up to num input items into a single command.\n"
+  "  -s num : pack input items into a single command until the command\n"
+  "           line reaches num bytes.\n"
+  "  --pipe : stdin is data rather than commands. pararun splits it into\n"
+  "           blocks at item boundaries and feeds each block to a separate\n"
+  "           instance of the prefix command. the outputs are concatenated\n"
+  "           in the input order. implies -q.\n"
+  "  --block=size: the block size for --pipe. accepts k, m, g suffixes.\n"
+  "           defaults to 1m. an item must fit into a block.\n"
+  "  --workers: start the prefix command only -j times and send the input\n"
+  "           items to these long running workers over their stdin. saves\n"
+  "           the startup cost of interpreters. protocol: pararun writes an\n"
+  "           item followed by the separator (newline by default) to an\n"
+  "           idle worker. the worker writes the item's output followed by a\n"
+  "           nul byte and flushes. the outputs are printed in input order.\n"
+  "           the workers' stderr is not buffered.\n"
+  "  --cache=dir: cache the output of the successful commands in dir. the key\n"
+  "           is the hash of the command and the contents of its input files.\n"
+  "           an argument starting with < declares an input file, pararun\n"
+  "           removes the < before running the command. a cached command is\n"
+  "           not run again, pararun just replays its output.\n"
+  "  --dag  : each input line starts with a node id, optionally followed by\n"
+  "           a colon and the comma separated ids of the nodes it depends on\n"
+  "           (e.g. \"link:a,b gcc -o x a.o b.o\"). the rest of the line is\n"
+  "           the command. the dependencies must come on earlier lines. a\n"
+  "           node starts once its dependencies succeeded, the ones on the\n"
+  "           longest remaining path first. if a node fails its dependents\n"
+  "           are skipped. the output is still printed in input order.\n"
+  "  --history=file: record the commands' runtimes in file and use them to\n"
+  "           estimate the path lengths for the scheduling. without --dag\n"
+  "           pararun then reads the whole input into memory before it\n"
+  "           starts the first command, there's no limit and no fallback to\n"
+  "           streaming, so don't use it on an endless input. it starts the\n"
+  "           longest commands first. the output is still printed in input\n"
+  "           order. unless -q pararun reports the estimated and the\n"
+  "           achieved makespan on stderr at the end.\n"
+  "  --pin[=core|l2|l3]: pin each command to a cpu core (the default) or\n"
+  "           to a group of cpus sharing an l2 or l3 cache. the commands go\n"
+  "           to the least loaded group. without -j pararun runs one command\n"
+  "           per core, or one per cpu in the l2 and l3 modes.\n"
+  "  --reserve=num: with --pin keep the first num cores free for the\n"
+  "           interactive session.\n"
+  "  --cgroups: run each command in its own cgroup v2 child cgroup. this\n"
+  "           needs a writable (e.g. delegated) cgroup, otherwise pararun\n"
+  "           warns and runs the commands without cgroups. pararun moves\n"
+  "           itself into a child cgroup too. the limits below and the\n"
+  "           memory and io columns of --report need pararun to be the only\n"
+  "           process in its cgroup, e.g. with systemd-run --user --scope -p\n"
+  "           Delegate=yes pararun ..., unless that cgroup already passes\n"
+  "           the controllers down. otherwise pararun warns and ignores them.\n"
+  "  --memory-max=size: the memory.max limit of each command's cgroup.\n"
+  "           accepts k, m, g suffixes. implies --cgroups.\n"
+  "  --cpu-weight=num: the cpu.weight (1-10000) of each command's cgroup.\n"
+  "           implies --cgroups.\n"
+  "  --host=cmd: also run commands on the worker started by cmd (through\n"
+  "           sh -c), e.g. --host='ssh paks pararun --worker'. the worker\n"
+  "           announces its slot count and pararun keeps that many commands\n"
+  "           running on it on top of the local -j ones. the output and the\n"
+  "           exit codes are handled the same way as for the local commands.\n"
+  "           can be repeated. cannot be combined with --pipe and --workers.\n"
+  "  --worker: serve a --host: run the commands arriving on stdin, up to -j\n"
+  "           at once, and send their output and exit status to stdout. the\n"
+  "           commands run in the worker's working directory.\n"
+  "  --report=file: write a tab separated line to file as each command\n"
+  "           finishes: its input position, exit code, wall seconds, cpu\n"
+  "           seconds, peak memory bytes, io bytes and the command itself.\n"
+  "           the last three come from the cgroup, they are - without one.\n"
+  "if a prefix argument contains {} then it is repeated for each input item\n"
+  "of the command with the {} replaced by the whole item. otherwise the items\n"
+  "are appended to the prefix (split on spaces unless -0 is used).\n"
+  "pararun cooperates with make's jobserver. if MAKEFLAGS advertises one then\n"
+  "pararun takes a token from it for each job beyond the first one. otherwise\n"
+  "pararun runs its own jobserver with -j tokens and advertises it to the\n"
+  "children so nested makes and pararuns share the same budget.\n"
   "examples:\n"
   "parallel wordcount:\n"
   "  ls | pararun wc\n"
   "to download bunch of files:\n"
   "  pararun -j99 <urls.txt wget\n"
   "to compile bunch of files:\n"
-  "  for f in *.c; do echo gcc -o ${f%.c} $f; done | pararun -q\n";
+  "  for f in *.c; do echo gcc -o ${f%.c} $f; done | pararun -q\n"
+  "to compile only the changed files next time:\n"
+  "  ls *.c | pararun -q --cache=/tmp/ccache gcc -c '<{}'\n"
+  "to checksum files with spaces in their names, 100 files per md5sum:\n"
+  "  find -type f -print0 | pararun -0 -n 100 md5sum\n"
+  "to convert images:\n"
+  "  ls *.png | pararun -q convert {} {}.jpg\n"
+  "to compile on two more machines too:\n"
+  "  ls *.c | pararun -q --host='ssh ipi cd src \\&\\& pararun --worker' \\\n"
+  "    --host='ssh eper cd src \\&\\& pararun --worker' gcc -c\n"
+  "to grep a large compressed log on all cores:\n"
+  "  zcat big.log.gz | pararun --pipe grep foo\n"
+  "to checksum files with long running shell workers:\n"
+  "  ls | pararun -q --workers sh -c 'while read -r f; do\n"
+  "    md5sum \"$f\"; printf \"\\0\"; done'\n";
 
 // check is like an assert but always enabled.
 #define check(cond) checkfunc(cond, #cond, __FILE__, __LINE__)
@@ -46,48 +148,2181 @@ void checkfunc(bool ok, const char *s, const char *file, int line) {
   exit(1);
 }
 
-enum { maxargs = 999 };
+enum { maxargs = 99999 };
 enum { maxline = 99999 };
 enum { maxthreads = 9999 };
 
+// buf is a growable byte buffer.
+struct buf {
+  char *data;
+  int len;
+  int cap;
+};
+
+void bufappend(struct buf *b, const char *data, int len) {
+  if (b->len + len > b->cap) {
+    b->cap = 2 * (b->len + len) + 64;
+    check((b->data = realloc(b->data, b->cap)) != NULL);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+// job is the state of a command in the default mode.
+struct job {
+  // pid is the command's pid, 0 after it was reaped. wstatus is its wait
+  // status after that.
+  int pid;
+  int wstatus;
+
+  // fd is the read end of the command's output pipe. outputdone is set when
+  // all of its output was printed.
+  int fd;
+  bool outputdone;
+
+  // cachefd is the temporary cache entry where the output is copied, -1 if
+  // the output shouldn't be cached. cachekey is the entry's name.
+  int cachefd;
+  char cachekey[2 * EVP_MAX_MD_SIZE + 1];
+
+  // started is set once the command started. skipped is set if it won't run
+  // because one of its dependencies failed.
+  bool started;
+  bool skipped;
+
+  // hash identifies the command in the history. starttime is when it started.
+  uint64_t hash;
+  struct timespec starttime;
+
+  // cpugroup is the index of the --pin group the command runs on, -1 if it
+  // is not pinned.
+  int cpugroup;
+
+  // cgroup is the number of the command's cgroup, -1 if it has none. index is
+  // the command's position in the --report file. command is its text for the
+  // report, NULL without --report.
+  int cgroup;
+  int index;
+  char *command;
+
+  // host is the index of the --host the command runs on, -1 if it runs
+  // locally. a remote job's pid is -1 until its result arrives, remotefd
+  // collects its output until then.
+  int host;
+  int remotefd;
+};
+
+// cpugroup is a set of cpus the --pin mode places the commands on.
+struct cpugroup {
+  cpu_set_t cpus;
+
+  // load is the number of commands running on the group.
+  int load;
+};
+
+// node is a command of the --dag or the --history mode. all of them are read
+// up front.
+struct node {
+  // id is the offset of the node's id in g.items, -1 without --dag. the
+  // node's command is built from the itemcount nul terminated items at
+  // g.items.data[item..item+itemlen).
+  int id;
+  int item;
+  int itemlen;
+  int itemcount;
+
+  // the node's dependencies are g.edges[deps..deps+depscount) and its
+  // dependents are g.dependents[dependents..dependents+dependentscount).
+  int deps;
+  int depscount;
+  int dependents;
+  int dependentscount;
+
+  // waiting is the number of dependencies that didn't finish yet.
+  int waiting;
+
+  // duration is the estimated runtime of the node in seconds. priority is the
+  // estimated length of the longest path from the node's start to the end.
+  double duration;
+  double priority;
+};
+
+// histentry is a runtime record of a command in the --history file.
+struct histentry {
+  uint64_t hash;
+  double seconds;
+};
+
 static struct {
   // prefixargs represents the number of arguments passed in on the command line
-  // argument.
+  // argument. prefix points to them.
   int prefixargs;
+  char **prefix;
+
+  // placeholderargs is the number of prefix args containing {}. placeholders is
+  // the total count of the {}s in them. placeholderbytes is the size of the
+  // placeholder args without the {}s. prefixbytes is the size of the other
+  // prefix args. these are needed to compute the size of a batch.
+  int placeholderargs;
+  int placeholders;
+  int placeholderbytes;
+  int prefixbytes;
+
+  // delim separates the input items. it is '\n' by default, '\0' with -0 or
+  // the --sep character. only newline separated items are split on spaces.
+  char delim;
+
+  // pipemode corresponds to --pipe. blocksize is the --block size. block is
+  // the mmapped buffer of the current --pipe block. its first blocklen bytes go
+  // to the next command, the carrylen bytes after that are the beginning of
+  // the next block.
+  bool pipemode;
+  long blocksize;
+  char *block;
+  long blocklen;
+  long carrylen;
+
+  // batchitems and batchbytes are the -n and -s limits of a single command.
+  int batchitems;
+  long batchbytes;
+
+  // item is the last item read from stdin. pendingitem is set when it didn't
+  // fit into the previous batch so it has to go into the next one. inputdone
+  // is set once all items are consumed.
+  char *item;
+  size_t itemcap;
+  int itemlen;
+  bool pendingitem;
+  bool inputdone;
+
+  // batch holds the items of the next command, each terminated by a nul.
+  // batchcount is the number of them.
+  struct buf batch;
+  int batchcount;
+
+  // cmdbuf holds the arguments of the next command, each terminated by a nul.
+  struct buf cmdbuf;
+
+  // args holds the arguments. pararun passes this to execvp in the forked
+  // children.
+  char *args[maxargs + 1];
+
+  // threadscount represent the number of children to run simultaneously. this
+  // is the same as the -j argument.
+  int threadscount;
+
+  // quietmode corresponds to the -q parameter.
+  bool quietmode;
+
+  // inbuf is the scratch buffer for the output.
+  char inbuf[maxline + 1];
+
+  // currentthread is the thread index at the head of all threads. this is the
+  // thread whose pipe's output goes to stdout at the moment.
+  int currentthread;
+
+  // nextthread should be next thread index.
+  int nextthread;
+
+  // runningthreads represents the number of threads running currently.
+  int runningthreads;
+
+  // jobs[i % jobscap] holds the state of the ith command (starting from 0).
+  // jobscap is maxthreads when the commands are streamed from stdin. in the
+  // --dag mode there is a job for each node and one more so that the
+  // currentthread != nextthread check keeps working.
+  struct job *jobs;
+  int jobscap;
+
+  // started and finished means the number of threads started and finished. only
+  // used for diagnostics.
+  int started;
+  int finished;
+
+  // jobserver is the nonblocking read end of the make jobserver, -1 if there
+  // is none. jobserverwrite is where the tokens go back. each running thread
+  // except the first one holds a token. the bytes of the held tokens are in
+  // tokens[0..tokenscount-1] so they can be returned as they were.
+  int jobserver;
+  int jobserverwrite;
+  int tokenscount;
+  char tokens[maxthreads];
+
+  // pid is pararun's own pid. the forked children inherit the atexit handlers
+  // so those do nothing in a process with a different pid.
+  int pid;
+
+  // wanttoken is set when a new thread could start but the jobserver had no
+  // free token. the main loop then polls the jobserver for one.
+  bool wanttoken;
+
+  // workermode corresponds to --workers. workers holds the workers started so
+  // far. results[i % maxthreads] holds the item and the output of the ith
+  // item. the outputs are kept in memory because a worker's stdout is shared
+  // among many items.
+  bool workermode;
+  struct worker *workers;
+  int workerscount;
+  struct result *results;
+
+  // cachedir is the --cache directory, NULL if caching is disabled. hits and
+  // misses count the commands found and not found in the cache.
+  const char *cachedir;
+  int hits;
+  int misses;
+
+  // returncode is the maximum exit code so far.
+  int returncode;
+
+  // dagmode corresponds to --dag. preload is set when the whole input is
+  // read up front into nodes. that's the case with --dag and with --history.
+  // nodes holds nodescount nodes. items holds the nodes' nul terminated ids
+  // and items. edges and dependents hold the dependency lists of the nodes.
+  // idtable is a hash table (open addressing) of node indices by id, idcap is
+  // its size. ready is a max-heap of the nodes that can start, by priority.
+  // skipstack is scratch space.
+  bool dagmode;
+  bool preload;
+  struct node *nodes;
+  int nodescount;
+  struct buf items;
+  struct buf edges;
+  int *dependents;
+  int *idtable;
+  int idcap;
+  int *ready;
+  int readycount;
+  int *skipstack;
+
+  // historyfile is the --history file, NULL if there's none. history is a hash
+  // table (open addressing) of the runtimes by command hash, historycap is its
+  // size and historycount is the number of entries in it.
+  const char *historyfile;
+  struct histentry *history;
+  int historycap;
+  int historycount;
+
+  // estimatedmakespan is the expected runtime of the preloaded nodes.
+  double estimatedmakespan;
+
+  // pinlevel is 0 without --pin, 1 for core pinning, 2 or 3 for l2 or l3
+  // cache group pinning. reserve is the --reserve count. cpugroups holds the
+  // cpugroupscount groups to pin the commands on.
+  int pinlevel;
+  int reserve;
+  struct cpugroup *cpugroups;
+  int cpugroupscount;
+
+  // usecgroups is set if the commands should run in their own cgroups.
+  // cgroupdir is the cgroup v2 directory holding them, NULL if that's not
+  // possible. cgroupbase is the cgroup pararun started in, cgroupenabled[i]
+  // is set if pararun enabled cgroupcontrollers[i] in it. cgroupscount is the
+  // number of cgroups created in cgroupdir so far. memorymax and cpuweight are
+  // the limits of each cgroup, 0 if unset.
+  bool usecgroups;
+  char *cgroupdir;
+  char *cgroupbase;
+  bool cgroupenabled[3];
+  int cgroupscount;
+  long memorymax;
+  int cpuweight;
+
+  // report is the --report file, NULL if there's none.
+  FILE *report;
+
+  // servemode is set in the --worker mode. hosts are the hostscount --host
+  // workers, remoterunning is the number of jobs running on them. these jobs
+  // don't count in runningthreads because they don't need jobserver tokens.
+  bool servemode;
+  struct host *hosts;
+  int hostscount;
+  int remoterunning;
+} g;
+
+// worker is a long running process of the --workers mode.
+struct worker {
+  int pid;
+
+  // in and out are pararun's end of the worker's stdin and stdout. they are -1
+  // once the worker exited.
+  int in;
+  int out;
+
+  // seq is the index of the item the worker is working on, -1 if idle.
+  int seq;
+
+  // cpugroup is the index of the --pin group of the worker, -1 if none.
+  int cpugroup;
+};
+
+// host is a remote worker of the --host mode.
+struct host {
+  // command is the transport command and pid is its process, 0 after it was
+  // reaped. fd is pararun's end of the socket connected to the command's
+  // stdin and stdout, -1 after the host exited.
+  const char *command;
+  int pid;
+  int fd;
+
+  // slots is the number of commands the host runs at once, running is the
+  // number of jobs on it. in buffers the incomplete frames from the host.
+  int slots;
+  int running;
+  struct buf in;
+};
+
+// result is the state of an item in the --workers mode.
+struct result {
+  struct buf item;
+  struct buf out;
+  bool done;
+};
+
+// reopenfd returns a new nonblocking file description for the pipe or fifo
+// behind fd. pararun cannot just set O_NONBLOCK on the inherited jobserver fd
+// because that flag is shared with make and the other clients.
+int reopenfd(int fd) {
+  char path[64];
+  sprintf(path, "/proc/self/fd/%d", fd);
+  return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+// jobserverinit connects to make's jobserver if MAKEFLAGS advertises a usable
+// one. otherwise it sets up a jobserver with threadscount tokens (the first
+// one is implicit) and advertises it to the children through MAKEFLAGS.
+void jobserverinit(void) {
+  g.jobserver = -1;
+  g.jobserverwrite = -1;
+  const char *makeflags = getenv("MAKEFLAGS");
+  const char *auth = NULL;
+  for (const char *p = makeflags; p != NULL && *p != 0; p++) {
+    if (strncmp(p, "--jobserver-auth=", 17) == 0) auth = p + 17;
+    if (strncmp(p, "--jobserver-fds=", 16) == 0) auth = p + 16;
+  }
+  if (auth != NULL && strncmp(auth, "fifo:", 5) == 0) {
+    char path[PATH_MAX];
+    int len = strcspn(auth + 5, " ");
+    if (len < PATH_MAX) {
+      memcpy(path, auth + 5, len);
+      path[len] = 0;
+      g.jobserver = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      g.jobserverwrite = g.jobserver;
+    }
+  } else if (auth != NULL) {
+    int rfd, wfd;
+    if (sscanf(auth, "%d,%d", &rfd, &wfd) == 2 && fcntl(rfd, F_GETFD) != -1 &&
+        fcntl(wfd, F_GETFD) != -1) {
+      g.jobserver = reopenfd(rfd);
+      g.jobserverwrite = wfd;
+    }
+  }
+  if (g.jobserver != -1) return;
+  if (auth != NULL) {
+    fputs("pararun: warning: jobserver unavailable, using -j.\n", stderr);
+  }
+
+  // become the jobserver. the fds stay inheritable for the children.
+  int pipefds[2];
+  check(pipe(pipefds) == 0);
+  for (int i = 1; i < g.threadscount; i++) {
+    check(write(pipefds[1], "+", 1) == 1);
+  }
+  g.jobserver = reopenfd(pipefds[0]);
+  check(g.jobserver != -1);
+  g.jobserverwrite = pipefds[1];
+  char *newflags;
+  const char *fmt = "%s -j%d --jobserver-auth=%d,%d";
+  if (makeflags == NULL) makeflags = "";
+  check(asprintf(&newflags, fmt, makeflags, g.threadscount, pipefds[0],
+                 pipefds[1]) != -1);
+  check(setenv("MAKEFLAGS", newflags, 1) == 0);
+  free(newflags);
+}
+
+// acquiretoken makes sure there is a token for one more running thread. it
+// returns false if the jobserver has no free token at the moment.
+bool acquiretoken(void) {
+  if (g.runningthreads == 0 || g.tokenscount >= g.runningthreads) return true;
+  char token;
+  int rby = read(g.jobserver, &token, 1);
+  if (rby == -1 && (errno == EAGAIN || errno == EINTR)) return false;
+  check(rby == 1);
+  g.tokens[g.tokenscount++] = token;
+  return true;
+}
+
+// releasetokens returns the tokens that the running threads no longer need.
+void releasetokens(void) {
+  int needed = g.runningthreads > 0 ? g.runningthreads - 1 : 0;
+  while (g.tokenscount > needed) {
+    char token = g.tokens[--g.tokenscount];
+    check(write(g.jobserverwrite, &token, 1) == 1);
+  }
+}
+
+// returnalltokens runs at exit so that an early exit doesn't leak tokens from
+// make's jobserver.
+void returnalltokens(void) {
+  if (getpid() != g.pid) return;
+  g.runningthreads = 0;
+  if (g.jobserverwrite != -1) releasetokens();
+}
+
+// countwords returns the number of space separated words in s.
+int countwords(const char *s, int len) {
+  int words = 0;
+  for (int i = 0; i < len; i++) {
+    if (s[i] != ' ' && (i == 0 || s[i - 1] == ' ')) words++;
+  }
+  return words;
+}
+
+// readitem reads the next item from stdin into g.item. returns false at the
+// end of the input.
+bool readitem(void) {
+  while (true) {
+    int len = getdelim(&g.item, &g.itemcap, g.delim, stdin);
+    if (len == -1) {
+      check(feof(stdin) != 0);
+      return false;
+    }
+    if (g.delim != '\n') {
+      if (g.item[len - 1] == g.delim) len--;
+      g.item[len] = 0;
+      g.itemlen = len;
+      return true;
+    }
+    if (g.item[len - 1] != '\n') {
+      puts("input error. missing newline?");
+      printf("bad line: %s\n", g.item);
+      exit(1);
+    }
+    g.item[--len] = 0;
+    g.itemlen = len;
+    // empty lines would be empty commands so skip them.
+    if (countwords(g.item, len) > 0) return true;
+  }
+}
+
+// readbatch collects the items of the next command into g.batch. returns false
+// if there are no more items.
+bool readbatch(void) {
+  g.batch.len = 0;
+  g.batchcount = 0;
+  int batchargs = g.prefixargs - g.placeholderargs;
+  long batchbytes = g.prefixbytes;
+  while (g.batchcount < g.batchitems) {
+    if (!g.pendingitem && !readitem()) {
+      g.inputdone = true;
+      break;
+    }
+    g.pendingitem = true;
+    int itemargs, itembytes;
+    if (g.placeholderargs > 0) {
+      itemargs = g.placeholderargs;
+      itembytes = g.placeholderbytes + g.placeholders * g.itemlen;
+    } else {
+      itemargs = g.delim != '\n' ? 1 : countwords(g.item, g.itemlen);
+      itembytes = g.itemlen + 1;
+    }
+    bool fits = batchargs + itemargs <= maxargs;
+    fits = fits && batchbytes + itembytes <= g.batchbytes;
+    if (g.batchcount > 0 && !fits) break;
+    if (batchargs + itemargs > maxargs) {
+      puts("too many arguments for a command.");
+      exit(1);
+    }
+    bufappend(&g.batch, g.item, g.itemlen + 1);
+    g.batchcount++;
+    g.pendingitem = false;
+    batchargs += itemargs;
+    batchbytes += itembytes;
+  }
+  return g.batchcount > 0;
+}
+
+// substitute appends arg to g.cmdbuf with each {} replaced by item.
+void substitute(const char *arg, const char *item) {
+  const char *p;
+  while ((p = strstr(arg, "{}")) != NULL) {
+    bufappend(&g.cmdbuf, arg, p - arg);
+    bufappend(&g.cmdbuf, item, strlen(item));
+    arg = p + 2;
+  }
+  bufappend(&g.cmdbuf, arg, strlen(arg) + 1);
+}
+
+// buildargs sets up g.args from the prefix and the items in g.batch. returns
+// the number of the args.
+int buildargs(void) {
+  g.cmdbuf.len = 0;
+  for (int i = 0; i < g.prefixargs; i++) {
+    const char *arg = g.prefix[i];
+    if (strstr(arg, "{}") == NULL) {
+      bufappend(&g.cmdbuf, arg, strlen(arg) + 1);
+      continue;
+    }
+    const char *item = g.batch.data;
+    for (int j = 0; j < g.batchcount; j++) {
+      substitute(arg, item);
+      item += strlen(item) + 1;
+    }
+  }
+  if (g.placeholderargs == 0) {
+    char *item = g.batch.data;
+    for (int j = 0; j < g.batchcount; j++) {
+      int len = strlen(item);
+      if (g.delim != '\n') {
+        bufappend(&g.cmdbuf, item, len + 1);
+      } else {
+        for (char *tok = strtok(item, " "); tok; tok = strtok(NULL, " ")) {
+          bufappend(&g.cmdbuf, tok, strlen(tok) + 1);
+        }
+      }
+      item += len + 1;
+    }
+  }
+  int a = 0;
+  for (int i = 0; i < g.cmdbuf.len; i += strlen(g.cmdbuf.data + i) + 1) {
+    g.args[a++] = g.cmdbuf.data + i;
+  }
+  g.args[a] = NULL;
+  return a;
+}
+
+// readblock reads the next --pipe block from stdin into g.block. each block
+// gets a fresh mapping because the previous one might still be referenced from
+// a pipe by vmsplice. returns false at the end of the input.
+bool readblock(void) {
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  char *buf = mmap(NULL, g.blocksize, prot, flags, -1, 0);
+  check(buf != MAP_FAILED);
+  long len = g.carrylen;
+  if (g.block != NULL) {
+    memcpy(buf, g.block + g.blocklen, g.carrylen);
+    check(munmap(g.block, g.blocksize) == 0);
+  }
+  g.block = buf;
+  long rby = 1;
+  while (len < g.blocksize && rby != 0) {
+    rby = read(0, buf + len, g.blocksize - len);
+    if (rby == -1 && errno == EINTR) continue;
+    check(rby >= 0);
+    len += rby;
+  }
+  if (len == 0) {
+    g.inputdone = true;
+    return false;
+  }
+  g.blocklen = len;
+  if (rby != 0) {
+    char *end = memrchr(buf, g.delim, len);
+    if (end == NULL) {
+      printf("input error. an item is longer than %ld bytes.\n", g.blocksize);
+      exit(1);
+    }
+    g.blocklen = end + 1 - buf;
+  }
+  g.carrylen = len - g.blocklen;
+  return true;
+}
+
+// blockfd returns an fd from which the next command can read the current
+// block. normally that's a pipe large enough for the whole block so that
+// vmsplice can move the block's pages into it without copying and without
+// blocking. if the pipe cannot be enlarged (e.g. the user's pipe quota is
+// used up) then the block is copied into a memfd instead.
+int blockfd(void) {
+  int pipefds[2];
+  check(pipe2(pipefds, O_CLOEXEC) == 0);
+  if (fcntl(pipefds[1], F_SETPIPE_SZ, g.blocklen) >= g.blocklen) {
+    struct iovec iov = {g.block, g.blocklen};
+    while (iov.iov_len > 0) {
+      long wby = vmsplice(pipefds[1], &iov, 1, 0);
+      if (wby == -1 && errno == EINTR) continue;
+      check(wby > 0);
+      iov.iov_base = (char *)iov.iov_base + wby;
+      iov.iov_len -= wby;
+    }
+    check(close(pipefds[1]) == 0);
+    return pipefds[0];
+  }
+  check(close(pipefds[0]) == 0);
+  check(close(pipefds[1]) == 0);
+  int fd = memfd_create("pararun", MFD_CLOEXEC);
+  check(fd != -1);
+  check(write(fd, g.block, g.blocklen) == g.blocklen);
+  check(lseek(fd, 0, SEEK_SET) == 0);
+  return fd;
+}
+
+// parsesize parses a byte count with an optional k, m or g suffix.
+long parsesize(const char *s) {
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (*end == 'k' || *end == 'K') v <<= 10, end++;
+  if (*end == 'm' || *end == 'M') v <<= 20, end++;
+  if (*end == 'g' || *end == 'G') v <<= 30, end++;
+  if (*end != 0) return -1;
+  return v;
+}
+
+// parsecpulist parses a kernel cpu list such as "0-3,8,10-11" into set.
+void parsecpulist(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s != 0 && *s != '\n') {
+    char *end;
+    int lo = strtol(s, &end, 10), hi = lo;
+    if (*end == '-') hi = strtol(end + 1, &end, 10);
+    for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+    s = *end == ',' ? end + 1 : end;
+  }
+}
+
+// readcpulist reads a cpu list from a sysfs file. returns false if the file
+// doesn't exist.
+bool readcpulist(const char *path, cpu_set_t *set) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return false;
+  char line[4096];
+  bool ok = fgets(line, sizeof(line), f) != NULL;
+  check(fclose(f) == 0);
+  if (ok) parsecpulist(line, set);
+  return ok;
+}
+
+// cpugroupof reads the cpus sharing the given level (1 for the core, 2 or 3
+// for the caches) with cpu into set. returns false if sysfs doesn't know.
+bool cpugroupof(int cpu, int level, cpu_set_t *set) {
+  char path[256];
+  const char *sys = "/sys/devices/system/cpu";
+  if (level == 1) {
+    sprintf(path, "%s/cpu%d/topology/thread_siblings_list", sys, cpu);
+    return readcpulist(path, set);
+  }
+  for (int index = 0;; index++) {
+    sprintf(path, "%s/cpu%d/cache/index%d/level", sys, cpu, index);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+    int cachelevel = 0;
+    bool ok = fscanf(f, "%d", &cachelevel) == 1;
+    check(fclose(f) == 0);
+    if (!ok || cachelevel != level) continue;
+    sprintf(path, "%s/cpu%d/cache/index%d/shared_cpu_list", sys, cpu, index);
+    return readcpulist(path, set);
+  }
+}
+
+// addcpugroup adds set to the groups unless it is already there.
+void addcpugroup(cpu_set_t *set) {
+  for (int i = 0; i < g.cpugroupscount; i++) {
+    if (CPU_EQUAL(&g.cpugroups[i].cpus, set)) return;
+  }
+  g.cpugroups[g.cpugroupscount].cpus = *set;
+  g.cpugroups[g.cpugroupscount].load = 0;
+  g.cpugroupscount++;
+}
+
+// pininit reads the cpu topology and sets up the --pin groups. the first
+// --reserve cores and the cpus outside pararun's own affinity are left out.
+void pininit(void) {
+  cpu_set_t allowed, reserved;
+  check(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+  CPU_ZERO(&reserved);
+  g.cpugroups = calloc(CPU_SETSIZE, sizeof(g.cpugroups[0]));
+  check(g.cpugroups != NULL);
+  // the core groups come first so that the reserved ones can be picked.
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    cpu_set_t core;
+    if (!cpugroupof(cpu, 1, &core)) {
+      CPU_ZERO(&core);
+      CPU_SET(cpu, &core);
+    }
+    addcpugroup(&core);
+  }
+  for (int i = 0; i < g.reserve && i < g.cpugroupscount; i++) {
+    CPU_OR(&reserved, &reserved, &g.cpugroups[i].cpus);
+  }
+  if (g.pinlevel > 1) {
+    g.cpugroupscount = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed)) continue;
+      cpu_set_t cache;
+      if (!cpugroupof(cpu, g.pinlevel, &cache)) {
+        CPU_ZERO(&cache);
+        CPU_SET(cpu, &cache);
+      }
+      addcpugroup(&cache);
+    }
+  }
+  int count = 0;
+  for (int i = 0; i < g.cpugroupscount; i++) {
+    cpu_set_t *cpus = &g.cpugroups[i].cpus, taken;
+    CPU_AND(cpus, cpus, &allowed);
+    CPU_AND(&taken, cpus, &reserved);
+    CPU_XOR(cpus, cpus, &taken);
+    if (CPU_COUNT(cpus) > 0) g.cpugroups[count++].cpus = *cpus;
+  }
+  g.cpugroupscount = count;
+  if (count == 0) {
+    puts("--reserve leaves no cpus for the commands.");
+    exit(1);
+  }
+}
+
+// pickcpugroup returns the least loaded --pin group and accounts a new command
+// on it. returns -1 without --pin.
+int pickcpugroup(void) {
+  if (g.pinlevel == 0) return -1;
+  int best = 0;
+  for (int i = 1; i < g.cpugroupscount; i++) {
+    if (g.cpugroups[i].load < g.cpugroups[best].load) best = i;
+  }
+  g.cpugroups[best].load++;
+  return best;
+}
+
+// releasecpugroup accounts a finished command on its --pin group.
+void releasecpugroup(int group) {
+  if (group != -1) g.cpugroups[group].load--;
+}
+
+// pinself moves the calling (child) process to the group.
+void pinself(int group) {
+  if (group == -1) return;
+  cpu_set_t *cpus = &g.cpugroups[group].cpus;
+  check(sched_setaffinity(0, sizeof(*cpus), cpus) == 0);
+}
+
+// cgroupbase finds pararun's own cgroup v2 directory. returns false if there's
+// no cgroup v2 hierarchy.
+bool cgroupbase(char *path, int size) {
+  char line[4096], mount[PATH_MAX] = "", cgroup[PATH_MAX] = "";
+  FILE *f = fopen("/proc/self/mountinfo", "r");
+  if (f == NULL) return false;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    // the fields are: id parent dev root mountpoint ... - fstype source opts.
+    char *sep = strstr(line, " - cgroup2 ");
+    if (sep == NULL) continue;
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", mount) != 1) mount[0] = 0;
+    break;
+  }
+  check(fclose(f) == 0);
+  if ((f = fopen("/proc/self/cgroup", "r")) == NULL) return false;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+    line[strcspn(line, "\n")] = 0;
+    snprintf(cgroup, sizeof(cgroup), "%s", line + 3);
+    break;
+  }
+  check(fclose(f) == 0);
+  if (mount[0] == 0 || cgroup[0] == 0) return false;
+  if (strcmp(cgroup, "/") == 0) cgroup[0] = 0;
+  return snprintf(path, size, "%s%s", mount, cgroup) < size;
+}
+
+// writecgroup writes value into a file of the cgroup dir. returns false on
+// failure.
+bool writecgroup(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  int len = strlen(value);
+  bool ok = write(fd, value, len) == len;
+  check(close(fd) == 0);
+  return ok;
+}
+
+// readcgroup reads a file of the cgroup dir into buf. returns false if it
+// doesn't exist.
+bool readcgroup(const char *dir, const char *file, char *buf, int size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  int len = 0, rby;
+  while (len < size - 1 && (rby = read(fd, buf + len, size - 1 - len)) > 0) {
+    len += rby;
+  }
+  buf[len] = 0;
+  check(close(fd) == 0);
+  return true;
+}
+
+// hascontroller returns whether the space separated list contains name.
+bool hascontroller(const char *list, const char *name) {
+  int len = strlen(name);
+  for (const char *p = list; (p = strstr(p, name)) != NULL; p += len) {
+    bool start = p == list || p[-1] == ' ';
+    bool end = p[len] == 0 || p[len] == ' ' || p[len] == '\n';
+    if (start && end) return true;
+  }
+  return false;
+}
+
+// cgroupwarn prints a warning about the cgroups.
+void cgroupwarn(const char *msg) {
+  fprintf(stderr, "pararun: %s, running the commands without cgroups.\n", msg);
+}
+
+// cgroupcontrollers are the controllers pararun enables for the commands.
+const char *cgroupcontrollers[] = {"memory", "cpu", "io"};
+
+// cgroupcleanup removes the cgroups that were still busy when their command
+// was reaped and then pararun's own cgroups. pararun moves itself back to its
+// original cgroup for that, which only takes it back without the controllers
+// that pararun enabled there. those can only be disabled there once they are
+// disabled in pararun.<pid>.
+void cgroupcleanup(void) {
+  if (getpid() != g.pid) return;
+  char path[PATH_MAX], value[16];
+  for (int i = 0; i < g.cgroupscount; i++) {
+    snprintf(path, sizeof(path), "%s/%d", g.cgroupdir, i);
+    rmdir(path);
+  }
+  for (int i = 0; i < 3; i++) {
+    if (!g.cgroupenabled[i]) continue;
+    snprintf(value, sizeof(value), "-%s", cgroupcontrollers[i]);
+    writecgroup(g.cgroupdir, "cgroup.subtree_control", value);
+    writecgroup(g.cgroupbase, "cgroup.subtree_control", value);
+  }
+  sprintf(value, "%d", g.pid);
+  writecgroup(g.cgroupbase, "cgroup.procs", value);
+  snprintf(path, sizeof(path), "%s/self", g.cgroupdir);
+  rmdir(path);
+  rmdir(g.cgroupdir);
+}
+
+// cgroupinit creates the pararun.<pid> cgroup under which each command gets
+// its own child cgroup. it leaves g.cgroupdir NULL if that's not possible.
+// cgroup v2 only passes memory and io down from a cgroup without processes so
+// pararun moves itself into the self child of pararun.<pid> and enables the
+// controllers in pararun.<pid>. moving itself also checks that a delegated
+// cgroup allows moving processes into the child cgroups. pararun.<pid> only
+// gets the controllers that pararun's original cgroup passes down. if pararun
+// was the only process there (e.g. in a cgroup delegated to it by systemd-run)
+// then it enables the missing ones there too until it exits. the limits are
+// just not available otherwise.
+void cgroupinit(void) {
+  char base[PATH_MAX], dir[PATH_MAX + 32], self[PATH_MAX + 48];
+  char msg[PATH_MAX + 128], value[16], list[256], available[256];
+  if (!cgroupbase(base, sizeof(base))) {
+    cgroupwarn("no cgroup v2 hierarchy");
+    return;
+  }
+  snprintf(dir, sizeof(dir), "%s/pararun.%d", base, g.pid);
+  snprintf(self, sizeof(self), "%s/self", dir);
+  if (mkdir(dir, 0755) != 0) {
+    snprintf(msg, sizeof(msg), "cannot create %s: %m", dir);
+    cgroupwarn(msg);
+    return;
+  }
+  if (mkdir(self, 0755) != 0) {
+    snprintf(msg, sizeof(msg), "cannot create %s: %m", self);
+    check(rmdir(dir) == 0);
+    cgroupwarn(msg);
+    return;
+  }
+  sprintf(value, "%d", g.pid);
+  if (!writecgroup(self, "cgroup.procs", value)) {
+    check(rmdir(self) == 0);
+    check(rmdir(dir) == 0);
+    cgroupwarn("cannot move processes into a child cgroup");
+    return;
+  }
+  check((g.cgroupdir = strdup(dir)) != NULL);
+  check((g.cgroupbase = strdup(base)) != NULL);
+  atexit(cgroupcleanup);
+  if (!readcgroup(base, "cgroup.controllers", available, sizeof(available))) {
+    available[0] = 0;
+  }
+  if (!readcgroup(base, "cgroup.subtree_control", list, sizeof(list))) {
+    list[0] = 0;
+  }
+  char procs[16];
+  bool alone = readcgroup(base, "cgroup.procs", procs, sizeof(procs));
+  alone = alone && procs[0] == 0;
+  for (int i = 0; i < 3; i++) {
+    const char *name = cgroupcontrollers[i];
+    snprintf(value, sizeof(value), "+%s", name);
+    if (alone && hascontroller(available, name) && !hascontroller(list, name)) {
+      g.cgroupenabled[i] = writecgroup(base, "cgroup.subtree_control", value);
+    }
+    writecgroup(dir, "cgroup.subtree_control", value);
+  }
+  if (!readcgroup(dir, "cgroup.subtree_control", list, sizeof(list))) {
+    list[0] = 0;
+  }
+  if (g.memorymax > 0 && !hascontroller(list, "memory")) {
+    fputs("pararun: no memory controller, ignoring --memory-max.\n", stderr);
+    g.memorymax = 0;
+  }
+  if (g.cpuweight > 0 && !hascontroller(list, "cpu")) {
+    fputs("pararun: no cpu controller, ignoring --cpu-weight.\n", stderr);
+    g.cpuweight = 0;
+  }
+}
+
+// cgroupcreate creates a new cgroup for a command with the limits applied.
+// returns its number, -1 without cgroups. procsfd is set to the cgroup's
+// cgroup.procs file which the command writes its pid into. if the cgroup
+// cannot be set up then the command runs without one, pararun warns about the
+// first such command.
+int cgroupcreate(int *procsfd) {
+  *procsfd = -1;
+  if (g.cgroupdir == NULL) return -1;
+  int id = g.cgroupscount++;
+  char dir[PATH_MAX + 16], procs[PATH_MAX + 32], value[32];
+  snprintf(dir, sizeof(dir), "%s/%d", g.cgroupdir, id);
+  snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+  bool ok = mkdir(dir, 0755) == 0;
+  if (ok && g.memorymax > 0) {
+    sprintf(value, "%ld", g.memorymax);
+    ok = writecgroup(dir, "memory.max", value);
+  }
+  if (ok && g.cpuweight > 0) {
+    sprintf(value, "%d", g.cpuweight);
+    ok = writecgroup(dir, "cpu.weight", value);
+  }
+  if (ok) ok = (*procsfd = open(procs, O_WRONLY | O_CLOEXEC)) != -1;
+  if (ok) return id;
+  static bool warned;
+  if (!warned) {
+    fprintf(stderr, "pararun: cannot set up %s: %m, running the command "
+            "without a cgroup.\n", dir);
+    warned = true;
+  }
+  rmdir(dir);
+  return -1;
+}
+
+// cgroupstats collects the resource usage of a command's cgroup and removes
+// the cgroup. the values are -1 if they are not available.
+void cgroupstats(int id, long *cpuusec, long *mempeak, long *iobytes) {
+  *cpuusec = *mempeak = *iobytes = -1;
+  if (id == -1) return;
+  char dir[PATH_MAX + 16], buf[8192], *p;
+  snprintf(dir, sizeof(dir), "%s/%d", g.cgroupdir, id);
+  if (readcgroup(dir, "cpu.stat", buf, sizeof(buf))) {
+    if ((p = strstr(buf, "usage_usec ")) != NULL) *cpuusec = atol(p + 11);
+  }
+  if (readcgroup(dir, "memory.peak", buf, sizeof(buf))) *mempeak = atol(buf);
+  if (readcgroup(dir, "io.stat", buf, sizeof(buf))) {
+    // one line per device: "8:0 rbytes=1 wbytes=2 rios=3 ...".
+    *iobytes = 0;
+    for (p = buf; (p = strstr(p, "bytes=")) != NULL; p += 6) {
+      if (p[-1] == 'r' || p[-1] == 'w') *iobytes += atol(p + 6);
+    }
+  }
+  // this fails if the command left processes behind, cgroupcleanup retries.
+  rmdir(dir);
+}
+
+// startworker starts a new worker process and returns it.
+struct worker *startworker(void) {
+  int infds[2], outfds[2];
+  check(pipe2(infds, O_CLOEXEC) == 0);
+  check(pipe2(outfds, O_CLOEXEC) == 0);
+  int cpugroup = pickcpugroup();
+  int chpid = fork();
+  if (chpid == -1) {
+    printf("could not fork: %m\n");
+    exit(1);
+  }
+  if (chpid == 0) {
+    check(dup2(infds[0], 0) == 0);
+    check(dup2(outfds[1], 1) == 1);
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    check(sigprocmask(SIG_SETMASK, &sigmask, NULL) == 0);
+    signal(SIGPIPE, SIG_DFL);
+    pinself(cpugroup);
+    execvp(g.prefix[0], g.prefix);
+    fprintf(stderr, "execvp failed: %m\n");
+    _exit(1);
+  }
+  check(close(infds[0]) == 0);
+  check(close(outfds[1]) == 0);
+  struct worker *w = &g.workers[g.workerscount++];
+  w->pid = chpid;
+  w->in = infds[1];
+  w->out = outfds[0];
+  w->seq = -1;
+  w->cpugroup = cpugroup;
+  g.runningthreads++;
+  return w;
+}
+
+// stopworker closes pararun's end of the worker's pipes. the process itself is
+// reaped at the end.
+void stopworker(struct worker *w) {
+  check(close(w->in) == 0);
+  check(close(w->out) == 0);
+  w->in = -1;
+  w->out = -1;
+  releasecpugroup(w->cpugroup);
+  g.runningthreads--;
+  releasetokens();
+}
+
+// runworkers is the main loop of the --workers mode. returns the exit code.
+int runworkers(void) {
+  int returncode = 0;
+  check((g.workers = calloc(g.threadscount, sizeof(g.workers[0]))) != NULL);
+  check((g.results = calloc(maxthreads, sizeof(g.results[0]))) != NULL);
+  // writing to a worker that died must not kill pararun.
+  signal(SIGPIPE, SIG_IGN);
+  int nextseq = 0, printseq = 0;
+  struct pollfd *pfds = calloc(g.threadscount + 1, sizeof(pfds[0]));
+  struct worker **pworkers = calloc(g.threadscount, sizeof(pworkers[0]));
+  check(pfds != NULL && pworkers != NULL);
+  while (true) {
+    // hand out the items to the idle workers. start new workers if needed.
+    g.wanttoken = false;
+    while (!g.inputdone && nextseq - printseq < maxthreads) {
+      if (!g.pendingitem && !readitem()) {
+        g.inputdone = true;
+        break;
+      }
+      g.pendingitem = true;
+      struct worker *w = NULL;
+      for (int i = 0; w == NULL && i < g.workerscount; i++) {
+        if (g.workers[i].in != -1 && g.workers[i].seq == -1) w = &g.workers[i];
+      }
+      if (w == NULL && g.workerscount < g.threadscount) {
+        if (!acquiretoken()) {
+          g.wanttoken = true;
+          break;
+        }
+        w = startworker();
+      }
+      if (w == NULL) break;
+      g.pendingitem = false;
+      struct result *r = &g.results[nextseq % maxthreads];
+      r->item.len = 0;
+      r->out.len = 0;
+      r->done = false;
+      bufappend(&r->item, g.item, g.itemlen);
+      bufappend(&r->item, &g.delim, 1);
+      w->seq = nextseq++;
+      // the worker is idle so it is reading its stdin. a failed write means
+      // it died, that's handled when its stdout hits eof.
+      for (int off = 0; off < r->item.len;) {
+        int wby = write(w->in, r->item.data + off, r->item.len - off);
+        if (wby == -1 && errno == EINTR) continue;
+        if (wby == -1) break;
+        off += wby;
+      }
+    }
+
+    // print the finished results in order.
+    while (printseq < nextseq && g.results[printseq % maxthreads].done) {
+      struct result *r = &g.results[printseq % maxthreads];
+      if (!g.quietmode) {
+        check(write(1, "\e[33m", 5) == 5);
+        check(write(1, r->item.data, r->item.len - 1) == r->item.len - 1);
+        check(write(1, "\e[0m\n", 5) == 5);
+      }
+      check(write(1, r->out.data, r->out.len) == r->out.len);
+      printseq++;
+    }
+    if (g.inputdone && printseq == nextseq) break;
+    if (g.runningthreads == 0 && g.workerscount == g.threadscount) {
+      puts("pararun: all workers exited.");
+      exit(1);
+    }
+
+    // wait for the outputs of the busy workers.
+    int pfdscount = 0;
+    for (int i = 0; i < g.workerscount; i++) {
+      if (g.workers[i].out == -1 || g.workers[i].seq == -1) continue;
+      pworkers[pfdscount] = &g.workers[i];
+      pfds[pfdscount].fd = g.workers[i].out;
+      pfds[pfdscount].events = POLLIN;
+      pfdscount++;
+    }
+    int jobserverpfd = pfdscount;
+    if (g.wanttoken) {
+      pfds[pfdscount].fd = g.jobserver;
+      pfds[pfdscount].events = POLLIN;
+      pfdscount++;
+    }
+    check(poll(pfds, pfdscount, -1) >= 0);
+    for (int i = 0; i < jobserverpfd; i++) {
+      if (pfds[i].revents == 0) continue;
+      struct worker *w = pworkers[i];
+      struct result *r = &g.results[w->seq % maxthreads];
+      int rby = read(w->out, g.inbuf, maxline);
+      if (rby == -1 && errno == EINTR) continue;
+      check(rby >= 0);
+      if (rby == 0) {
+        const char msg[] = "pararun: the worker exited.\n";
+        bufappend(&r->out, msg, strlen(msg));
+        r->done = true;
+        if (returncode == 0) returncode = 1;
+        stopworker(w);
+        continue;
+      }
+      char *end = memchr(g.inbuf, 0, rby);
+      bufappend(&r->out, g.inbuf, end == NULL ? rby : end - g.inbuf);
+      if (end == NULL) continue;
+      if (end != g.inbuf + rby - 1) {
+        puts("pararun: a worker wrote data after the nul terminator.");
+        exit(1);
+      }
+      r->done = true;
+      w->seq = -1;
+    }
+  }
+
+  free(pfds);
+  free(pworkers);
+
+  // close the workers' stdin so that they exit.
+  for (int i = 0; i < g.workerscount; i++) {
+    if (g.workers[i].in != -1) stopworker(&g.workers[i]);
+  }
+  for (int i = 0; i < g.workerscount; i++) {
+    int wstatus;
+    check(waitpid(g.workers[i].pid, &wstatus, 0) == g.workers[i].pid);
+    if (WIFEXITED(wstatus)) {
+      if (WEXITSTATUS(wstatus) > returncode) returncode = WEXITSTATUS(wstatus);
+    } else if (returncode == 0) {
+      returncode = 1;
+    }
+  }
+  return returncode;
+}
+
+// the --host protocol consists of frames. a frame is a type byte, a sequence
+// number and the payload length (both 32 bit little endian) and the payload.
+// the worker starts with a 'h' frame with its slot count in decimal. then
+// pararun sends 'r' frames with the nul terminated arguments of a command to
+// run. the worker answers with 'o' frames carrying the command's output and a
+// final 'x' frame with its 32 bit wait status. the sequence number identifies
+// the command in these.
+enum { frameheader = 9 };
+
+void putu32(char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+uint32_t getu32(const char *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) v |= (uint32_t)(uint8_t)p[i] << (8 * i);
+  return v;
+}
+
+// appendframe appends a frame to b.
+void appendframe(struct buf *b, char type, uint32_t seq, const char *data,
+                 uint32_t len) {
+  char header[frameheader];
+  header[0] = type;
+  putu32(header + 1, seq);
+  putu32(header + 5, len);
+  bufappend(b, header, frameheader);
+  bufappend(b, data, len);
+}
+
+// parseframe parses the frame at the start of data. returns its total length,
+// 0 if it's not complete yet.
+int parseframe(const char *data, int len, char *type, uint32_t *seq,
+               uint32_t *payloadlen) {
+  if (len < frameheader) return 0;
+  *type = data[0];
+  *seq = getu32(data + 1);
+  *payloadlen = getu32(data + 5);
+  if (*payloadlen > (uint32_t)INT_MAX - frameheader) {
+    puts("pararun: bad frame.");
+    exit(1);
+  }
+  if (len - frameheader < (int64_t)*payloadlen) return 0;
+  return frameheader + *payloadlen;
+}
+
+// servedcmd is a command run by the --worker mode.
+struct servedcmd {
+  int pid;
+  int fd;
+  uint32_t seq;
+};
+
+// servestart starts the command of an 'r' frame.
+void servestart(struct servedcmd *cmd, uint32_t seq, char *data, int len) {
+  int argc = 0;
+  for (int i = 0; i < len && argc < maxargs; i += strlen(data + i) + 1) {
+    g.args[argc++] = data + i;
+  }
+  g.args[argc] = NULL;
+  if (argc == 0 || data[len - 1] != 0) {
+    puts("pararun: bad command frame.");
+    exit(1);
+  }
+  int pipefds[2];
+  check(pipe2(pipefds, O_CLOEXEC) == 0);
+  int chpid = fork();
+  check(chpid != -1);
+  if (chpid == 0) {
+    check(dup2(pipefds[1], 1) == 1);
+    check(dup2(pipefds[1], 2) == 2);
+    signal(SIGPIPE, SIG_DFL);
+    execvp(g.args[0], g.args);
+    printf("execvp failed: %m\n");
+    fflush(stdout);
+    _exit(1);
+  }
+  check(close(pipefds[1]) == 0);
+  cmd->pid = chpid;
+  cmd->fd = pipefds[0];
+  cmd->seq = seq;
+}
+
+// serve is the main loop of the --worker mode. stdin and stdout carry the
+// frames, the commands run in parallel as they arrive. returns the exit code.
+int serve(void) {
+  // pararun might disappear any time, the writes must not block or kill the
+  // worker. the commands' output is not read while the frames are backed up.
+  signal(SIGPIPE, SIG_IGN);
+  int flags = fcntl(1, F_GETFL);
+  check(flags != -1 && fcntl(1, F_SETFL, flags | O_NONBLOCK) == 0);
+  struct buf in = {}, out = {};
+  char hello[16];
+  appendframe(&out, 'h', 0, hello, sprintf(hello, "%d", g.threadscount));
+  struct servedcmd *cmds = calloc(maxthreads, sizeof(cmds[0]));
+  struct pollfd *pfds = calloc(maxthreads + 2, sizeof(pfds[0]));
+  check(cmds != NULL && pfds != NULL);
+  int cmdscount = 0;
+  bool indone = false;
+  while (!indone || cmdscount > 0 || out.len > 0) {
+    pfds[0].fd = indone || cmdscount == maxthreads ? -1 : 0;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = out.len > 0 ? 1 : -1;
+    pfds[1].events = POLLOUT;
+    for (int i = 0; i < cmdscount; i++) {
+      pfds[2 + i].fd = out.len < (1 << 20) ? cmds[i].fd : -1;
+      pfds[2 + i].events = POLLIN;
+    }
+    if (poll(pfds, 2 + cmdscount, -1) == -1 && errno == EINTR) continue;
+    if (pfds[1].revents != 0) {
+      int wby = write(1, out.data, out.len);
+      if (wby == -1 && errno != EAGAIN && errno != EINTR) return 1;
+      if (wby > 0) {
+        memmove(out.data, out.data + wby, out.len - wby);
+        out.len -= wby;
+      }
+    }
+    if (pfds[0].revents != 0) {
+      int rby = read(0, g.inbuf, maxline);
+      if (rby == -1 && errno != EAGAIN && errno != EINTR) rby = 0;
+      if (rby == 0) indone = true;
+      if (rby > 0) bufappend(&in, g.inbuf, rby);
+      int off = 0, framelen;
+      char type;
+      uint32_t seq, len;
+      while (cmdscount < maxthreads &&
+             (framelen = parseframe(in.data + off, in.len - off, &type, &seq,
+                                    &len)) > 0) {
+        if (type != 'r') {
+          puts("pararun: unexpected frame.");
+          exit(1);
+        }
+        char *data = in.data + off + frameheader;
+        servestart(&cmds[cmdscount++], seq, data, len);
+        off += framelen;
+      }
+      if (off > 0) memmove(in.data, in.data + off, in.len - off);
+      in.len -= off;
+    }
+    for (int i = cmdscount - 1; i >= 0; i--) {
+      if (pfds[2 + i].fd == -1 || pfds[2 + i].revents == 0) continue;
+      struct servedcmd *cmd = &cmds[i];
+      int rby = read(cmd->fd, g.inbuf, maxline);
+      if (rby == -1 && errno == EINTR) continue;
+      check(rby >= 0);
+      if (rby > 0) {
+        appendframe(&out, 'o', cmd->seq, g.inbuf, rby);
+        continue;
+      }
+      int wstatus;
+      check(close(cmd->fd) == 0);
+      check(waitpid(cmd->pid, &wstatus, 0) == cmd->pid);
+      char status[4];
+      putu32(status, wstatus);
+      appendframe(&out, 'x', cmd->seq, status, 4);
+      *cmd = cmds[--cmdscount];
+    }
+  }
+  free(in.data);
+  free(out.data);
+  free(cmds);
+  free(pfds);
+  return 0;
+}
+
+// hoststart starts the transport of a --host and reads its slot count.
+void hoststart(struct host *h) {
+  int fds[2];
+  check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+  int chpid = fork();
+  check(chpid != -1);
+  if (chpid == 0) {
+    check(dup2(fds[1], 0) == 0);
+    check(dup2(fds[1], 1) == 1);
+    execl("/bin/sh", "sh", "-c", h->command, (char *)NULL);
+    fprintf(stderr, "execl failed: %m\n");
+    _exit(1);
+  }
+  check(close(fds[1]) == 0);
+  h->pid = chpid;
+  h->fd = fds[0];
+  char type;
+  uint32_t seq, len;
+  while (parseframe(h->in.data, h->in.len, &type, &seq, &len) == 0) {
+    int rby = read(h->fd, g.inbuf, maxline);
+    if (rby == -1 && errno == EINTR) continue;
+    if (rby <= 0) {
+      printf("pararun: host %s did not start.\n", h->command);
+      exit(1);
+    }
+    bufappend(&h->in, g.inbuf, rby);
+  }
+  if (type != 'h' || len >= 16) {
+    printf("pararun: host %s sent a bad greeting.\n", h->command);
+    exit(1);
+  }
+  char slots[16];
+  memcpy(slots, h->in.data + frameheader, len);
+  slots[len] = 0;
+  h->slots = atoi(slots);
+  h->in.len -= frameheader + len;
+  memmove(h->in.data, h->in.data + frameheader + len, h->in.len);
+}
+
+// freehost returns a host with a free slot, -1 if there's none. it prefers
+// the host with the most free slots so that the load is spread according to
+// the slot counts.
+int freehost(void) {
+  int best = -1, bestfree = 0;
+  for (int i = 0; i < g.hostscount; i++) {
+    int free = g.hosts[i].slots - g.hosts[i].running;
+    if (g.hosts[i].fd != -1 && free > bestfree) best = i, bestfree = free;
+  }
+  return best;
+}
+
+// hostsend sends the command in g.args to the job's host.
+void hostsend(struct job *job, int argc) {
+  struct host *h = &g.hosts[job->host];
+  struct buf cmd = {}, frame = {};
+  for (int i = 0; i < argc; i++) {
+    bufappend(&cmd, g.args[i], strlen(g.args[i]) + 1);
+  }
+  appendframe(&frame, 'r', job - g.jobs, cmd.data, cmd.len);
+  for (int off = 0; off < frame.len;) {
+    int wby = send(h->fd, frame.data + off, frame.len - off, MSG_NOSIGNAL);
+    if (wby == -1 && errno == EINTR) continue;
+    // a dead host is noticed when reading from it.
+    if (wby == -1) break;
+    off += wby;
+  }
+  free(cmd.data);
+  free(frame.data);
+}
+
+// replay starts a local process that prints the remote job's output and then
+// exits the same way as the remote command did. this way the rest of pararun
+// handles the remote jobs the same way as the local ones.
+void replay(struct job *job, int wstatus) {
+  int pipefds[2];
+  check(pipe2(pipefds, O_CLOEXEC) == 0);
+  check(lseek(job->remotefd, 0, SEEK_SET) == 0);
+  int chpid = fork();
+  check(chpid != -1);
+  if (chpid == 0) {
+    check(dup2(pipefds[1], 1) == 1);
+    int wby;
+    while ((wby = sendfile(1, job->remotefd, NULL, 1 << 30)) > 0) continue;
+    check(wby == 0);
+    // _exit because exit would seek the shared stdin back to the unread data.
+    if (WIFEXITED(wstatus)) _exit(WEXITSTATUS(wstatus));
+    prctl(PR_SET_DUMPABLE, 0);
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    check(sigprocmask(SIG_SETMASK, &sigmask, NULL) == 0);
+    signal(WTERMSIG(wstatus), SIG_DFL);
+    raise(WTERMSIG(wstatus));
+    _exit(1);
+  }
+  check(close(pipefds[1]) == 0);
+  check(close(job->remotefd) == 0);
+  job->remotefd = -1;
+  job->fd = pipefds[0];
+  job->pid = chpid;
+}
+
+// hostdied fails the jobs that were running on the host.
+void hostdied(int host) {
+  struct host *h = &g.hosts[host];
+  check(close(h->fd) == 0);
+  h->fd = -1;
+  char msg[PATH_MAX];
+  int len = snprintf(msg, sizeof(msg), "pararun: host %s exited.\n",
+                     h->command);
+  for (int i = 0; i < g.jobscap; i++) {
+    struct job *job = &g.jobs[i];
+    if (job->host != host || job->pid != -1) continue;
+    check(write(job->remotefd, msg, len) == len);
+    replay(job, 1 << 8);
+  }
+}
+
+// hostread processes the frames arriving from the host.
+void hostread(int host) {
+  struct host *h = &g.hosts[host];
+  int rby = read(h->fd, g.inbuf, maxline);
+  if (rby == -1 && (errno == EINTR || errno == EAGAIN)) return;
+  if (rby <= 0) {
+    hostdied(host);
+    return;
+  }
+  bufappend(&h->in, g.inbuf, rby);
+  int off = 0, framelen;
+  char type;
+  uint32_t seq, len;
+  while ((framelen = parseframe(h->in.data + off, h->in.len - off, &type, &seq,
+                                &len)) > 0) {
+    char *data = h->in.data + off + frameheader;
+    off += framelen;
+    bool ok = seq < (uint32_t)g.jobscap && (type == 'o' || type == 'x');
+    ok = ok && g.jobs[seq].host == host && g.jobs[seq].pid == -1;
+    if (!ok) {
+      printf("pararun: host %s sent a bad frame.\n", h->command);
+      exit(1);
+    }
+    struct job *job = &g.jobs[seq];
+    if (type == 'o') {
+      check(write(job->remotefd, data, len) == (int)len);
+    } else {
+      check(len == 4);
+      replay(job, getu32(data));
+    }
+  }
+  memmove(h->in.data, h->in.data + off, h->in.len - off);
+  h->in.len -= off;
+}
+
+// hashfile adds the contents of the file at path to the hash.
+void hashfile(EVP_MD_CTX *ctx, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    check(EVP_DigestUpdate(ctx, "\0missing", 8) == 1);
+    return;
+  }
+  int rby;
+  while ((rby = read(fd, g.inbuf, maxline)) > 0) {
+    check(EVP_DigestUpdate(ctx, g.inbuf, rby) == 1);
+  }
+  check(rby == 0);
+  check(close(fd) == 0);
+}
+
+// computecachekey computes the cache key of the command in g.args into key.
+// it also strips the < markers from the input file arguments.
+void computecachekey(char *key) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  check(ctx != NULL);
+  check(EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1);
+  // the output contains the command unless -q so -q is part of the key.
+  check(EVP_DigestUpdate(ctx, g.quietmode ? "q" : "v", 1) == 1);
+  for (int i = 0; g.args[i] != NULL; i++) {
+    bool input = g.args[i][0] == '<';
+    g.args[i] += input;
+    check(EVP_DigestUpdate(ctx, g.args[i], strlen(g.args[i]) + 1) == 1);
+    if (input) hashfile(ctx, g.args[i]);
+  }
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned mdlen;
+  check(EVP_DigestFinal_ex(ctx, md, &mdlen) == 1);
+  EVP_MD_CTX_free(ctx);
+  for (unsigned i = 0; i < mdlen; i++) sprintf(key + 2 * i, "%02x", md[i]);
+}
+
+// cachepath returns the path of a cache entry. temporary entries of a job get
+// the pararun's pid and the job's slot in g.jobs as a suffix, -1 means the
+// final entry. commands with the same key can run at the same time so each job
+// needs its own temporary entry.
+char *cachepath(const char *key, int slot) {
+  static char path[PATH_MAX];
+  int len = snprintf(path, PATH_MAX, "%s/%s", g.cachedir, key);
+  if (slot != -1) {
+    len += snprintf(path + len, PATH_MAX - len, ".%d.%d", getpid(), slot);
+  }
+  check(len < PATH_MAX);
+  return path;
+}
+
+// finishcache moves the job's temporary cache entry into its place if the job
+// succeeded and its whole output is in the entry.
+void finishcache(struct job *job) {
+  if (job->cachefd == -1 || job->pid != 0 || !job->outputdone) return;
+  check(close(job->cachefd) == 0);
+  job->cachefd = -1;
+  char tmppath[PATH_MAX];
+  strcpy(tmppath, cachepath(job->cachekey, job - g.jobs));
+  bool ok = WIFEXITED(job->wstatus) && WEXITSTATUS(job->wstatus) == 0;
+  if (ok && rename(tmppath, cachepath(job->cachekey, -1)) == 0) return;
+  // an entry that is already in place (e.g. from a concurrent pararun) is
+  // just as good as this one.
+  if (ok) check(access(cachepath(job->cachekey, -1), F_OK) == 0);
+  check(unlink(tmppath) == 0);
+}
+
+// findjob returns the job of a running command.
+struct job *findjob(int pid) {
+  for (int i = 0; i < g.jobscap; i++) {
+    if (g.jobs[i].pid == pid) return &g.jobs[i];
+  }
+  check(false);
+  return NULL;
+}
+
+// progress formats the progress line into buf. returns its length.
+int progress(char *buf) {
+  int len = sprintf(buf, "\e[33m%d/%d done", g.finished, g.started);
+  if (g.cachedir != NULL) {
+    const char fmt[] = ", %d cached, %d run";
+    len += sprintf(buf + len, fmt, g.hits, g.misses);
+  }
+  len += sprintf(buf + len, "\e[0m");
+  return len;
+}
 
-  // args holds the arguments. pararun passes this to execvp in the forked
-  // children.
-  char *args[maxargs + 1];
+// fnv1a extends the 64 bit FNV-1a hash h with data.
+uint64_t fnv1a(uint64_t h, const void *data, int len) {
+  const unsigned char *p = data;
+  for (int i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3;
+  return h;
+}
 
-  // threadscount represent the number of children to run simultaneously. this
-  // is the same as the -j argument.
-  int threadscount;
+// hashargs returns the hash of the command in g.args.
+uint64_t hashargs(void) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (int i = 0; g.args[i] != NULL; i++) {
+    h = fnv1a(h, g.args[i], strlen(g.args[i]) + 1);
+  }
+  return h == 0 ? 1 : h;
+}
 
-  // quietmode corresponds to the -q parameter.
-  bool quietmode;
+// histslot returns the history table entry for hash. the entry's hash is 0 if
+// the command is not in the history yet.
+struct histentry *histslot(uint64_t hash) {
+  int mask = g.historycap - 1;
+  int i = hash & mask;
+  while (g.history[i].hash != 0 && g.history[i].hash != hash) {
+    i = (i + 1) & mask;
+  }
+  return &g.history[i];
+}
 
-  // inbuf holds the current input line.
-  char inbuf[maxline + 1];
+// histput records the runtime of a command in the history table.
+void histput(uint64_t hash, double seconds) {
+  if (2 * (g.historycount + 1) > g.historycap) {
+    struct histentry *old = g.history;
+    int oldcap = g.historycap;
+    g.historycap = oldcap == 0 ? 1024 : 2 * oldcap;
+    check((g.history = calloc(g.historycap, sizeof(g.history[0]))) != NULL);
+    for (int i = 0; i < oldcap; i++) {
+      if (old[i].hash != 0) *histslot(old[i].hash) = old[i];
+    }
+    free(old);
+  }
+  struct histentry *e = histslot(hash);
+  if (e->hash == 0) g.historycount++;
+  e->hash = hash;
+  e->seconds = seconds;
+}
 
-  // currentthread is the thread index at the head of all threads. this is the
-  // thread whose pipe's output goes to stdout at the moment.
-  int currentthread;
+// histget returns the recorded runtime of a command, -1 if it is unknown.
+double histget(uint64_t hash) {
+  if (g.historycount == 0) return -1;
+  struct histentry *e = histslot(hash);
+  return e->hash == 0 ? -1 : e->seconds;
+}
 
-  // nextthread should be next thread index.
-  int nextthread;
+// loadhistory reads the --history file. each line is a command hash and its
+// runtime in seconds.
+void loadhistory(void) {
+  FILE *f = fopen(g.historyfile, "r");
+  if (f == NULL) {
+    check(errno == ENOENT);
+    return;
+  }
+  uint64_t hash;
+  double seconds;
+  while (fscanf(f, "%" SCNx64 " %lf", &hash, &seconds) == 2) {
+    if (hash != 0) histput(hash, seconds);
+  }
+  check(fclose(f) == 0);
+}
 
-  // runningthreads represents the number of threads running currently.
-  int runningthreads;
+// savehistory writes the history table into the --history file atomically.
+void savehistory(void) {
+  char tmppath[PATH_MAX];
+  int len = snprintf(tmppath, PATH_MAX, "%s.%d", g.historyfile, getpid());
+  check(len < PATH_MAX);
+  FILE *f = fopen(tmppath, "w");
+  check(f != NULL);
+  for (int i = 0; i < g.historycap; i++) {
+    if (g.history[i].hash == 0) continue;
+    struct histentry *e = &g.history[i];
+    fprintf(f, "%016" PRIx64 " %.6f\n", e->hash, e->seconds);
+  }
+  check(fclose(f) == 0);
+  check(rename(tmppath, g.historyfile) == 0);
+}
 
-  // pipes[i % maxthreads] holds the read end of the running thread of the ith
-  // command (starting from 0).
-  int pipes[maxthreads];
+// idslot returns the idtable slot for the id. the slot is -1 if the id is not
+// in the table.
+int *idslot(const char *id) {
+  int mask = g.idcap - 1;
+  int i = fnv1a(0xcbf29ce484222325, id, strlen(id)) & mask;
+  while (g.idtable[i] != -1) {
+    if (strcmp(g.items.data + g.nodes[g.idtable[i]].id, id) == 0) break;
+    i = (i + 1) & mask;
+  }
+  return &g.idtable[i];
+}
 
-  // started and finished means the number of threads started and finished. only
-  // used for diagnostics.
-  int started;
-  int finished;
-} g;
+// idinsert adds the last node to the idtable. returns false if its id is
+// already taken.
+bool idinsert(void) {
+  if (2 * g.nodescount > g.idcap) {
+    int *old = g.idtable;
+    int oldcap = g.idcap;
+    g.idcap = oldcap == 0 ? 1024 : 2 * oldcap;
+    check((g.idtable = malloc(g.idcap * sizeof(g.idtable[0]))) != NULL);
+    memset(g.idtable, -1, g.idcap * sizeof(g.idtable[0]));
+    for (int i = 0; i < oldcap; i++) {
+      if (old[i] != -1) *idslot(g.items.data + g.nodes[old[i]].id) = old[i];
+    }
+    free(old);
+  }
+  int *slot = idslot(g.items.data + g.nodes[g.nodescount - 1].id);
+  if (*slot != -1) return false;
+  *slot = g.nodescount - 1;
+  return true;
+}
+
+// readybefore is the ordering of the ready heap: the longer the remaining
+// path the sooner the node starts. ties are broken by the input order.
+bool readybefore(int a, int b) {
+  if (g.nodes[a].priority != g.nodes[b].priority) {
+    return g.nodes[a].priority > g.nodes[b].priority;
+  }
+  return a < b;
+}
+
+void readypush(int node) {
+  int i = g.readycount++;
+  while (i > 0 && readybefore(node, g.ready[(i - 1) / 2])) {
+    g.ready[i] = g.ready[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  g.ready[i] = node;
+}
+
+void readypop(void) {
+  int node = g.ready[--g.readycount];
+  int i = 0;
+  while (true) {
+    int c = 2 * i + 1;
+    if (c >= g.readycount) break;
+    if (c + 1 < g.readycount && readybefore(g.ready[c + 1], g.ready[c])) c++;
+    if (readybefore(node, g.ready[c])) break;
+    g.ready[i] = g.ready[c];
+    i = c;
+  }
+  if (g.readycount > 0) g.ready[i] = node;
+}
+
+// estimatemakespan simulates the scheduling of the nodes with their estimated
+// durations and returns the estimated makespan in seconds.
+double estimatemakespan(void) {
+  // running is a min-heap of the simulated running nodes by their end time.
+  struct running {
+    double end;
+    int node;
+  } *running = malloc(g.threadscount * sizeof(running[0]));
+  check(running != NULL);
+  int runningcount = 0;
+  double now = 0;
+  for (int i = 0; i < g.nodescount; i++) {
+    if (g.nodes[i].waiting == 0) readypush(i);
+  }
+  while (true) {
+    while (runningcount < g.threadscount && g.readycount > 0) {
+      struct running r = {now + g.nodes[g.ready[0]].duration, g.ready[0]};
+      readypop();
+      int i = runningcount++;
+      while (i > 0 && r.end < running[(i - 1) / 2].end) {
+        running[i] = running[(i - 1) / 2];
+        i = (i - 1) / 2;
+      }
+      running[i] = r;
+    }
+    if (runningcount == 0) break;
+    struct node *done = &g.nodes[running[0].node];
+    now = running[0].end;
+    struct running last = running[--runningcount];
+    int i = 0;
+    while (2 * i + 1 < runningcount) {
+      int c = 2 * i + 1;
+      if (c + 1 < runningcount && running[c + 1].end < running[c].end) c++;
+      if (last.end <= running[c].end) break;
+      running[i] = running[c];
+      i = c;
+    }
+    running[i] = last;
+    for (int j = 0; j < done->dependentscount; j++) {
+      int dep = g.dependents[done->dependents + j];
+      if (--g.nodes[dep].waiting == 0) readypush(dep);
+    }
+  }
+  free(running);
+  for (int i = 0; i < g.nodescount; i++) {
+    g.nodes[i].waiting = g.nodes[i].depscount;
+  }
+  return now;
+}
+
+// nodebatch loads the items of a node into g.batch.
+void nodebatch(int node) {
+  g.batch.len = 0;
+  bufappend(&g.batch, g.items.data + g.nodes[node].item, g.nodes[node].itemlen);
+  g.batchcount = g.nodes[node].itemcount;
+}
+
+// readdagnode parses the next --dag line into node. returns false at the end
+// of the input.
+bool readdagnode(struct node *node) {
+  if (!readitem()) return false;
+  char *cmd = g.item + strcspn(g.item, " ");
+  if (*cmd == 0) {
+    printf("missing command in dag line: %s\n", g.item);
+    exit(1);
+  }
+  *cmd++ = 0;
+  cmd += strspn(cmd, " ");
+  char *deps = strchr(g.item, ':');
+  if (deps != NULL) *deps++ = 0;
+  node->id = g.items.len;
+  bufappend(&g.items, g.item, strlen(g.item) + 1);
+  node->item = g.items.len;
+  node->itemlen = strlen(cmd) + 1;
+  node->itemcount = 1;
+  bufappend(&g.items, cmd, node->itemlen);
+  node->deps = g.edges.len / sizeof(int);
+  char *dep = deps == NULL ? NULL : strtok(deps, ",");
+  for (; dep != NULL; dep = strtok(NULL, ",")) {
+    int depnode = g.nodescount == 0 ? -1 : *idslot(dep);
+    if (depnode == -1) {
+      printf("unknown dependency %s of %s. ", dep, g.item);
+      puts("dependencies must be declared on earlier lines.");
+      exit(1);
+    }
+    bufappend(&g.edges, (char *)&depnode, sizeof(depnode));
+    node->depscount++;
+  }
+  node->waiting = node->depscount;
+  return true;
+}
+
+// loadnodes reads all the nodes from stdin, computes their priorities and sets
+// up the jobs for them.
+void loadnodes(void) {
+  int nodescap = 0;
+  while (true) {
+    struct node node = {0};
+    if (g.dagmode) {
+      if (!readdagnode(&node)) break;
+    } else {
+      if (!readbatch()) break;
+      node.id = -1;
+      node.item = g.items.len;
+      node.itemlen = g.batch.len;
+      node.itemcount = g.batchcount;
+      bufappend(&g.items, g.batch.data, g.batch.len);
+    }
+    if (g.nodescount == nodescap) {
+      nodescap = 2 * nodescap + 64;
+      g.nodes = realloc(g.nodes, nodescap * sizeof(g.nodes[0]));
+      check(g.nodes != NULL);
+    }
+    g.nodes[g.nodescount++] = node;
+    if (g.dagmode && !idinsert()) {
+      printf("duplicate node id %s.\n", g.item);
+      exit(1);
+    }
+  }
+  g.inputdone = true;
+  int n = g.nodescount;
+  int *edges = (int *)g.edges.data;
+
+  // build the reverse edges.
+  int edgescount = g.edges.len / sizeof(int);
+  check((g.dependents = calloc(edgescount + 1, sizeof(int))) != NULL);
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < g.nodes[i].depscount; j++) {
+      g.nodes[edges[g.nodes[i].deps + j]].dependentscount++;
+    }
+  }
+  for (int i = 0, sum = 0; i < n; i++) {
+    g.nodes[i].dependents = sum;
+    sum += g.nodes[i].dependentscount;
+    g.nodes[i].dependentscount = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < g.nodes[i].depscount; j++) {
+      struct node *dep = &g.nodes[edges[g.nodes[i].deps + j]];
+      g.dependents[dep->dependents + dep->dependentscount++] = i;
+    }
+  }
+
+  // estimate the durations from the history. unknown commands get the
+  // average of the known ones.
+  double known = 0;
+  int knowncount = 0;
+  for (int i = 0; i < n; i++) {
+    nodebatch(i);
+    buildargs();
+    g.nodes[i].duration = histget(hashargs());
+    if (g.nodes[i].duration >= 0) {
+      known += g.nodes[i].duration;
+      knowncount++;
+    }
+  }
+  double unknown = knowncount == 0 ? 1 : known / knowncount;
+  for (int i = 0; i < n; i++) {
+    if (g.nodes[i].duration < 0) g.nodes[i].duration = unknown;
+  }
+
+  // the dependents come later in the input so a single backward pass computes
+  // the longest paths.
+  for (int i = n - 1; i >= 0; i--) {
+    struct node *node = &g.nodes[i];
+    double longest = 0;
+    for (int j = 0; j < node->dependentscount; j++) {
+      double p = g.nodes[g.dependents[node->dependents + j]].priority;
+      if (p > longest) longest = p;
+    }
+    node->priority = node->duration + longest;
+  }
+
+  g.jobscap = n + 1;
+  check((g.jobs = calloc(g.jobscap, sizeof(g.jobs[0]))) != NULL);
+  check((g.ready = malloc((n + 1) * sizeof(g.ready[0]))) != NULL);
+  check((g.skipstack = malloc((n + 1) * sizeof(g.skipstack[0]))) != NULL);
+  g.estimatedmakespan = estimatemakespan();
+  for (int i = 0; i < n; i++) {
+    g.jobs[i].cachefd = -1;
+    if (g.nodes[i].waiting == 0) readypush(i);
+  }
+  g.nextthread = n;
+}
+
+// nextnode returns the ready node with the highest priority, -1 if there's
+// none.
+int nextnode(void) {
+  while (g.readycount > 0 && g.jobs[g.ready[0]].started) readypop();
+  return g.readycount > 0 ? g.ready[0] : -1;
+}
+
+// headready returns whether the node at the head of the output could start.
+bool headready(void) {
+  if (g.currentthread < 0 || g.currentthread >= g.nodescount) return false;
+  struct job *job = &g.jobs[g.currentthread];
+  if (job->started || job->skipped) return false;
+  return g.nodes[g.currentthread].waiting == 0;
+}
+
+// nodedone updates the dependents of a finished node. if the node failed then
+// all nodes that transitively depend on it are skipped.
+void nodedone(int node, bool ok) {
+  int stacksize = 0;
+  g.skipstack[stacksize++] = node;
+  while (stacksize > 0) {
+    struct node *n = &g.nodes[g.skipstack[--stacksize]];
+    for (int i = 0; i < n->dependentscount; i++) {
+      int dep = g.dependents[n->dependents + i];
+      if (g.jobs[dep].skipped) continue;
+      if (ok) {
+        if (--g.nodes[dep].waiting == 0) readypush(dep);
+      } else {
+        g.jobs[dep].skipped = true;
+        g.skipstack[stacksize++] = dep;
+      }
+    }
+  }
+}
+
+// startjob starts the command built from g.batch as the seqth job. datafd is
+// the command's stdin in --pipe mode, -1 otherwise. host is the --host to run
+// the command on, -1 to run it locally.
+void startjob(int seq, int datafd, int host) {
+  // set up cmdline arguments for the child task.
+  int a = buildargs();
+  struct job *job = &g.jobs[seq];
+  bool skipped = job->skipped;
+  memset(job, 0, sizeof(*job));
+  job->skipped = skipped;
+  job->started = true;
+  job->cachefd = -1;
+  job->hash = hashargs();
+  job->host = host;
+  job->remotefd = -1;
+  job->cpugroup = host == -1 ? pickcpugroup() : -1;
+  job->index = g.preload ? seq : g.started;
+  if (g.report != NULL) {
+    struct buf cmd = {};
+    for (int i = 0; i < a; i++) {
+      if (i > 0) bufappend(&cmd, " ", 1);
+      bufappend(&cmd, g.args[i], strlen(g.args[i]));
+    }
+    bufappend(&cmd, "", 1);
+    job->command = cmd.data;
+  }
+  int procsfd = -1;
+  job->cgroup = host == -1 ? cgroupcreate(&procsfd) : -1;
+  int cachedfd = -1;
+  if (g.cachedir != NULL) {
+    computecachekey(job->cachekey);
+    cachedfd = open(cachepath(job->cachekey, -1), O_RDONLY | O_CLOEXEC);
+    if (cachedfd != -1) {
+      g.hits++;
+    } else {
+      g.misses++;
+      int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+      job->cachefd = open(cachepath(job->cachekey, seq), flags, 0666);
+      check(job->cachefd != -1);
+    }
+  }
+  if (host != -1) {
+    g.hosts[host].running++;
+    g.remoterunning++;
+  }
+  if (host != -1 && cachedfd == -1) {
+    // the output starts with the header so that the replay prints it too.
+    check((job->remotefd = memfd_create("pararun", MFD_CLOEXEC)) != -1);
+    if (!g.quietmode) {
+      check(dprintf(job->remotefd, "\e[33m") > 0);
+      for (int i = 0; i < a; i++) {
+        check(dprintf(job->remotefd, "%s ", g.args[i]) > 0);
+      }
+      check(dprintf(job->remotefd, "\e[0m\n") > 0);
+    }
+    g.started++;
+    check(clock_gettime(CLOCK_MONOTONIC, &job->starttime) == 0);
+    job->pid = -1;
+    job->fd = -1;
+    hostsend(job, a);
+    return;
+  }
+  // set up output redirection for the child task.
+  int pipefds[2];
+  check(pipe2(pipefds, 0) == 0);
+  int readfd = pipefds[0];
+  int writefd = pipefds[1];
+  int flags;
+  check((flags = fcntl(readfd, F_GETFD)) != -1);
+  check(fcntl(readfd, F_SETFD, flags | FD_CLOEXEC) != -1);
+  job->fd = readfd;
+  // start the child task.
+  g.started++;
+  check(clock_gettime(CLOCK_MONOTONIC, &job->starttime) == 0);
+  int chpid = fork();
+  if (chpid == -1) {
+    printf("could not fork: %m\n");
+    exit(1);
+  }
+  if (chpid == 0) {
+    check(close(1) == 0);
+    check(dup2(writefd, 1) == 1);
+    // in --pipe mode the output is data so keep stderr separate.
+    if (!g.pipemode) {
+      check(close(2) == 0);
+      check(dup2(writefd, 2) == 2);
+    }
+    check(close(writefd) == 0);
+    if (datafd != -1) check(dup2(datafd, 0) == 0);
+    pinself(job->cpugroup);
+    if (procsfd != -1) check(dprintf(procsfd, "%d", getpid()) > 0);
+    if (cachedfd != -1) {
+      // replay the cached output instead of running the command.
+      int wby;
+      while ((wby = sendfile(1, cachedfd, NULL, 1 << 30)) > 0) continue;
+      check(wby == 0);
+      _exit(0);
+    }
+    if (!g.quietmode) {
+      printf("\e[33m");
+      for (int i = 0; i < a; i++) {
+        printf("%s ", g.args[i]);
+      }
+      puts("\e[0m");
+      fflush(stdout);
+    }
+    execvp(g.args[0], g.args);
+    printf("execvp failed: %m\n");
+    // flush the message but skip pararun's atexit handlers and the other
+    // inherited stdio buffers.
+    fflush(stdout);
+    _exit(1);
+  } else {
+    check(close(writefd) == 0);
+    if (datafd != -1) check(close(datafd) == 0);
+    if (cachedfd != -1) check(close(cachedfd) == 0);
+    if (procsfd != -1) check(close(procsfd) == 0);
+  }
+  job->pid = chpid;
+  if (host == -1) g.runningthreads++;
+}
+
+// startjobs starts as many jobs as the limits allow.
+void startjobs(void) {
+  g.wanttoken = false;
+  while (true) {
+    int seq = g.nextthread;
+    if (g.preload) {
+      seq = nextnode();
+      if (seq == -1) break;
+    } else {
+      if (g.inputdone) break;
+      bool running = g.runningthreads > 0 || g.remoterunning > 0;
+      if (running && g.nextthread == g.currentthread) break;
+      if (g.jobs[g.nextthread].pid != 0) break;
+    }
+    bool free = g.runningthreads < g.threadscount;
+    if (free && !acquiretoken()) {
+      g.wanttoken = true;
+      free = false;
+    }
+    // the remote slots don't need jobserver tokens.
+    int host = -1;
+    if (!free && (host = freehost()) != -1) free = true;
+    // the node at the head of the output may exceed the limits by one.
+    // otherwise all the running nodes could be blocked on writing their output
+    // while the head is waiting for a free slot.
+    if (!free) {
+      if (!g.preload || !headready()) break;
+      seq = g.currentthread;
+    }
+    int datafd = -1;
+    if (g.preload) {
+      nodebatch(seq);
+    } else if (g.pipemode) {
+      if (!readblock()) break;
+      datafd = blockfd();
+    } else if (!readbatch()) {
+      break;
+    }
+    startjob(seq, datafd, host);
+    if (!g.preload) g.nextthread = (g.nextthread + 1) % g.jobscap;
+  }
+  releasetokens();
+}
+
+// reportvalue formats a --report column, "-" if the value is not available.
+const char *reportvalue(char *buf, long value) {
+  if (value < 0) return "-";
+  sprintf(buf, "%ld", value);
+  return buf;
+}
+
+// report writes a finished command's line into the --report file.
+void report(struct job *job, double seconds, long cpuusec, long mempeak,
+            long iobytes) {
+  int code = WIFEXITED(job->wstatus) ? WEXITSTATUS(job->wstatus)
+                                     : 128 + WTERMSIG(job->wstatus);
+  char cpu[32] = "-", mem[32], io[32];
+  if (cpuusec >= 0) sprintf(cpu, "%.3f", cpuusec * 1e-6);
+  fprintf(g.report, "%d\t%d\t%.3f\t%s\t%s\t%s\t%s\n", job->index, code,
+          seconds, cpu, reportvalue(mem, mempeak), reportvalue(io, iobytes),
+          job->command);
+}
+
+// reapjobs processes the finished children.
+void reapjobs(int sigfd) {
+  struct signalfd_siginfo sfdsi;
+  check(read(sigfd, &sfdsi, sizeof(sfdsi)) == sizeof(sfdsi));
+  check(sfdsi.ssi_signo == SIGCHLD);
+  int wstatus, pid;
+  while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+    // an exited host is handled when its socket hits eof.
+    bool hostpid = false;
+    for (int i = 0; i < g.hostscount; i++) {
+      if (g.hosts[i].pid == pid) g.hosts[i].pid = 0, hostpid = true;
+    }
+    if (hostpid) continue;
+    struct job *job = findjob(pid);
+    job->pid = 0;
+    job->wstatus = wstatus;
+    finishcache(job);
+    releasecpugroup(job->cpugroup);
+    g.finished++;
+    if (job->host == -1) {
+      g.runningthreads--;
+    } else {
+      g.hosts[job->host].running--;
+      g.remoterunning--;
+    }
+    bool ok = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+    if (WIFEXITED(wstatus)) {
+      if (WEXITSTATUS(wstatus) > g.returncode) {
+        g.returncode = WEXITSTATUS(wstatus);
+      }
+    } else if (g.returncode == 0) {
+      g.returncode = 1;
+    }
+    struct timespec now;
+    check(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    double seconds = now.tv_sec - job->starttime.tv_sec;
+    seconds += (now.tv_nsec - job->starttime.tv_nsec) * 1e-9;
+    if (g.historyfile != NULL && ok) histput(job->hash, seconds);
+    long cpuusec, mempeak, iobytes;
+    cgroupstats(job->cgroup, &cpuusec, &mempeak, &iobytes);
+    if (g.report != NULL) {
+      report(job, seconds, cpuusec, mempeak, iobytes);
+      free(job->command);
+      job->command = NULL;
+    }
+    if (g.preload) nodedone(job - g.jobs, ok);
+  }
+  releasetokens();
+}
+
+// flagvalue returns the value of the flag in argv[0] if it is the given flag.
+// the value is either attached ("-n9") or is the next argument ("-n 9"). it
+// consumes the flag from the args. returns NULL if argv[0] is not the flag.
+const char *flagvalue(const char *flag, int *argc, char ***argv) {
+  int len = strlen(flag);
+  char *arg = (*argv)[0];
+  if (strncmp(arg, flag, len) != 0) return NULL;
+  if (arg[len] != 0) {
+    *argc -= 1;
+    *argv += 1;
+    return arg + len;
+  }
+  if (*argc < 2) {
+    printf("missing argument for %s.\n", flag);
+    exit(1);
+  }
+  *argc -= 2;
+  *argv += 2;
+  return (*argv)[-1];
+}
 
 int main(int argc, char **argv) {
   // initalize globals, process cmdline flags.
@@ -95,7 +2330,7 @@ int main(int argc, char **argv) {
     fputs(usage, stdout);
     exit(0);
   }
-  g.threadscount = 2 * get_nprocs();
+  g.delim = '\n';
   argc--;
   argv++;
   while (argc >= 1) {
@@ -119,23 +2354,221 @@ int main(int argc, char **argv) {
       argv++;
       continue;
     }
+    if (strcmp(argv[0], "-0") == 0) {
+      g.delim = 0;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--pin") == 0) {
+      g.pinlevel = 1;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--worker") == 0) {
+      g.servemode = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--cgroups") == 0) {
+      g.usecgroups = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--dag") == 0) {
+      g.dagmode = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--workers") == 0) {
+      g.workermode = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[0], "--pipe") == 0) {
+      g.pipemode = true;
+      g.quietmode = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    const char *value;
+    if ((value = flagvalue("--cache=", &argc, &argv)) != NULL) {
+      g.cachedir = value;
+      if (mkdir(value, 0777) != 0 && errno != EEXIST) {
+        printf("could not create %s: %m\n", value);
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("--pin=", &argc, &argv)) != NULL) {
+      if (strcmp(value, "core") == 0) {
+        g.pinlevel = 1;
+      } else if (strcmp(value, "l2") == 0) {
+        g.pinlevel = 2;
+      } else if (strcmp(value, "l3") == 0) {
+        g.pinlevel = 3;
+      } else {
+        puts("bad argument to --pin. must be core, l2 or l3.");
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("--reserve=", &argc, &argv)) != NULL) {
+      g.reserve = atoi(value);
+      continue;
+    }
+    if ((value = flagvalue("--memory-max=", &argc, &argv)) != NULL) {
+      g.usecgroups = true;
+      g.memorymax = parsesize(value);
+      if (g.memorymax < 1) {
+        puts("bad argument to --memory-max. must be a positive size.");
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("--cpu-weight=", &argc, &argv)) != NULL) {
+      g.usecgroups = true;
+      g.cpuweight = atoi(value);
+      if (g.cpuweight < 1 || 10000 < g.cpuweight) {
+        puts("bad argument to --cpu-weight. must be between 1 and 10000.");
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("--host=", &argc, &argv)) != NULL) {
+      int n = g.hostscount + 1;
+      check((g.hosts = realloc(g.hosts, n * sizeof(g.hosts[0]))) != NULL);
+      memset(&g.hosts[g.hostscount], 0, sizeof(g.hosts[0]));
+      g.hosts[g.hostscount++].command = value;
+      continue;
+    }
+    if ((value = flagvalue("--report=", &argc, &argv)) != NULL) {
+      if ((g.report = fopen(value, "w")) == NULL) {
+        printf("could not create %s: %m\n", value);
+        exit(1);
+      }
+      // line buffered so that the forked children don't inherit half lines.
+      setvbuf(g.report, NULL, _IOLBF, 0);
+      continue;
+    }
+    if ((value = flagvalue("--history=", &argc, &argv)) != NULL) {
+      g.historyfile = value;
+      continue;
+    }
+    if ((value = flagvalue("--block=", &argc, &argv)) != NULL) {
+      g.blocksize = parsesize(value);
+      if (g.blocksize < 1) {
+        puts("bad argument to --block. must be a positive size.");
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("--sep=", &argc, &argv)) != NULL) {
+      if (strlen(value) != 1) {
+        puts("bad argument to --sep. must be a single character.");
+        exit(1);
+      }
+      g.delim = value[0];
+      continue;
+    }
+    if ((value = flagvalue("-n", &argc, &argv)) != NULL) {
+      g.batchitems = atoi(value);
+      if (g.batchitems < 1) {
+        puts("bad argument to -n. must be at least 1.");
+        exit(1);
+      }
+      continue;
+    }
+    if ((value = flagvalue("-s", &argc, &argv)) != NULL) {
+      g.batchbytes = atol(value);
+      if (g.batchbytes < 1) {
+        puts("bad argument to -s. must be at least 1.");
+        exit(1);
+      }
+      continue;
+    }
     break;
   }
+  if (g.pinlevel > 0) pininit();
+  if (g.threadscount == 0) {
+    g.threadscount = 2 * get_nprocs();
+    if (g.pinlevel == 1) g.threadscount = g.cpugroupscount;
+    if (g.pinlevel > 1) {
+      g.threadscount = 0;
+      for (int i = 0; i < g.cpugroupscount; i++) {
+        g.threadscount += CPU_COUNT(&g.cpugroups[i].cpus);
+      }
+    }
+  }
+  // without -n and -s every item is a separate command. with only -s there's
+  // no limit on the items. with only -n the command size is limited to a
+  // conservative fraction of ARG_MAX.
+  if (g.batchitems == 0) g.batchitems = g.batchbytes == 0 ? 1 : maxargs;
+  if (g.batchbytes == 0) g.batchbytes = sysconf(_SC_ARG_MAX) / 4;
+  if (g.blocksize == 0) g.blocksize = 1 << 20;
+  if ((g.pipemode || g.workermode) && argc == 0) {
+    puts("--pipe and --workers need a command.");
+    exit(1);
+  }
+  if (g.workermode && (g.pipemode || g.batchitems != 1)) {
+    puts("--workers cannot be combined with --pipe, -n or -s.");
+    exit(1);
+  }
+  if (g.cachedir != NULL && (g.pipemode || g.workermode)) {
+    puts("--cache cannot be combined with --pipe or --workers.");
+    exit(1);
+  }
+  if (g.dagmode && (g.pipemode || g.workermode || g.batchitems != 1)) {
+    puts("--dag cannot be combined with --pipe, --workers, -n or -s.");
+    exit(1);
+  }
+  if (g.hostscount > 0 && (g.pipemode || g.workermode || g.servemode)) {
+    puts("--host cannot be combined with --pipe, --workers or --worker.");
+    exit(1);
+  }
+  if ((g.usecgroups || g.report != NULL) && g.workermode) {
+    puts("--cgroups and --report cannot be combined with --workers.");
+    exit(1);
+  }
   g.prefixargs = argc;
+  g.prefix = argv;
   int prefixlen = 0;
   check(0 <= g.prefixargs && g.prefixargs <= maxargs);
   for (int i = 0; i < argc; i++) {
-    g.args[i] = argv[i];
-    prefixlen += strlen(argv[i]);
+    int len = strlen(argv[i]);
+    prefixlen += len;
+    int count = 0;
+    for (char *p = argv[i]; (p = strstr(p, "{}")) != NULL; p += 2) count++;
+    if (count == 0) {
+      g.prefixbytes += len + 1;
+    } else {
+      g.placeholderargs++;
+      g.placeholders += count;
+      g.placeholderbytes += len - 2 * count + 1;
+    }
   }
   check(prefixlen <= maxline);
   prctl(PR_SET_PDEATHSIG, SIGTERM);
+  g.pid = getpid();
+  if (g.historyfile != NULL) loadhistory();
+  if (g.usecgroups) cgroupinit();
+  for (int i = 0; i < g.hostscount; i++) hoststart(&g.hosts[i]);
+  jobserverinit();
+  atexit(returnalltokens);
 
   // close stdin on exec so children cannot accidentally consume the commands
   // from stdin.
   int fdflags = fcntl(0, F_GETFD);
   check(fdflags != -1);
   check(fcntl(0, F_SETFD, fdflags | FD_CLOEXEC) == 0);
+  if (g.workermode) return runworkers();
+  if (g.servemode) return serve();
 
   // set up the signalfd for handling the sigchld signals.
   sigset_t sigmask;
@@ -145,108 +2578,72 @@ int main(int argc, char **argv) {
   int sigfd = signalfd(-1, &sigmask, SFD_CLOEXEC);
   check(sigfd != -1);
 
+  g.preload = g.dagmode;
+  g.preload |= g.historyfile != NULL && !g.pipemode && !g.workermode;
+  if (g.preload) {
+    loadnodes();
+  } else {
+    g.jobscap = maxthreads;
+    check((g.jobs = calloc(g.jobscap, sizeof(g.jobs[0]))) != NULL);
+  }
+
   // run the main loop.
-  int returncode = 0;
+  struct pollfd *pfds = calloc(3 + g.hostscount, sizeof(pfds[0]));
+  check(pfds != NULL);
+  struct timespec starttime, endtime;
+  check(clock_gettime(CLOCK_MONOTONIC, &starttime) == 0);
   g.currentthread = -1;
   bool neednewline = false;
   while (true) {
-    // start the threads.
-    while (feof(stdin) == 0 && g.runningthreads < g.threadscount) {
-      if (fgets(g.inbuf, maxline + 1, stdin) == NULL) break;
-      if (g.runningthreads > 0 && g.nextthread == g.currentthread) break;
-      int linelen = strlen(g.inbuf);
-      if (linelen == 0 || g.inbuf[linelen - 1] != '\n') {
-        if (linelen == maxline) {
-          puts("input error. too long input line?");
-        } else {
-          puts("input error. missing newline?");
-        }
-        printf("bad line: %s\n", g.inbuf);
-        exit(1);
-      }
-      // set up cmdline arguments for the child task.
-      g.inbuf[--linelen] = 0;
-      char *tok = strtok(g.inbuf, " ");
-      int a = g.prefixargs;
-      do {
-        if (a == maxargs) {
-          printf("too many arguments for a command.");
-          exit(1);
-        }
-        g.args[a++] = tok;
-      } while ((tok = strtok(NULL, " ")) != NULL);
-      g.args[a] = NULL;
-      // set up output redirection for the child task.
-      int pipefds[2];
-      check(pipe2(pipefds, 0) == 0);
-      int readfd = pipefds[0];
-      int writefd = pipefds[1];
-      int flags;
-      check((flags = fcntl(readfd, F_GETFD)) != -1);
-      check(fcntl(readfd, F_SETFD, flags | FD_CLOEXEC) != -1);
-      g.pipes[g.nextthread] = readfd;
-      // start the child task.
-      g.started++;
-      int chpid = fork();
-      if (chpid == -1) {
-        printf("could not fork: %m\n");
-        exit(1);
-      }
-      if (chpid == 0) {
-        check(close(1) == 0);
-        check(close(2) == 0);
-        check(dup2(writefd, 1) == 1);
-        check(dup2(writefd, 2) == 2);
-        check(close(writefd) == 0);
-        if (!g.quietmode) {
-          printf("\e[33m");
-          for (int i = 0; i < a; i++) {
-            printf("%s ", g.args[i]);
-          }
-          puts("\e[0m");
-          fflush(stdout);
-        }
-        execvp(g.args[0], g.args);
-        printf("execvp failed: %m\n");
-        exit(1);
-      } else {
-        check(close(writefd) == 0);
+    startjobs();
+
+    // skip the nodes that didn't run because of a failed dependency.
+    if (g.currentthread == -1) g.currentthread = 0;
+    while (g.currentthread != g.nextthread && g.jobs[g.currentthread].skipped) {
+      if (!g.quietmode) {
+        const char *id = g.items.data + g.nodes[g.currentthread].id;
+        int len = sprintf(g.inbuf, "%s\e[33mskipped %.999s\e[0m\n",
+                          neednewline ? "\n" : "\r\e[K", id);
+        check(write(1, g.inbuf, len) == len);
+        neednewline = false;
       }
-      g.nextthread = (g.nextthread + 1) % maxthreads;
-      g.runningthreads++;
+      g.currentthread++;
     }
 
     // process the sigchld and the read events.
-    if (g.currentthread == -1) g.currentthread = 0;
-    if (g.runningthreads == 0 && g.currentthread == g.nextthread) break;
-    bool waitpipe = g.currentthread != g.nextthread;
-    struct pollfd pfds[2];
+    bool running = g.runningthreads > 0 || g.remoterunning > 0;
+    if (!running && g.currentthread == g.nextthread) break;
+    struct job *head = &g.jobs[g.currentthread];
+    bool waitpipe = g.currentthread != g.nextthread && head->started;
+    int pfdscount = 1;
     pfds[0].fd = sigfd;
     pfds[0].events = POLLIN;
+    pfds[1].revents = 0;
     if (waitpipe) {
-      pfds[1].fd = g.pipes[g.currentthread];
+      pfds[1].fd = head->fd;
       pfds[1].events = POLLIN;
+      pfdscount = 2;
+    }
+    if (g.wanttoken) {
+      pfds[pfdscount].fd = g.jobserver;
+      pfds[pfdscount].events = POLLIN;
+      pfdscount++;
+    }
+    int hostspfd = pfdscount;
+    for (int i = 0; i < g.hostscount; i++) {
+      pfds[pfdscount].fd = g.hosts[i].fd;
+      pfds[pfdscount].events = POLLIN;
+      pfdscount++;
+    }
+    check(poll(pfds, pfdscount, -1) >= 0);
+    for (int i = 0; i < g.hostscount; i++) {
+      if (pfds[hostspfd + i].revents != 0) hostread(i);
     }
-    check(poll(pfds, waitpipe ? 2 : 1, -1) >= 0);
     if ((pfds[0].revents & POLLIN) != 0) {
-      struct signalfd_siginfo sfdsi;
-      check(read(sigfd, &sfdsi, sizeof(sfdsi)) == sizeof(sfdsi));
-      check(sfdsi.ssi_signo == SIGCHLD);
-      int wstatus;
-      while (waitpid(-1, &wstatus, WNOHANG) > 0) {
-        g.finished++;
-        g.runningthreads--;
-        if (WIFEXITED(wstatus)) {
-          if (WEXITSTATUS(wstatus) > returncode) {
-            returncode = WEXITSTATUS(wstatus);
-          }
-        } else if (returncode == 0) {
-          returncode = 1;
-        }
-      }
+      reapjobs(sigfd);
       if (!g.quietmode && !neednewline) {
-        const char fmt[] = "\r\e[K\e[33m%d/%d done\e[0m";
-        int len = sprintf(g.inbuf, fmt, g.finished, g.started);
+        int len = sprintf(g.inbuf, "\r\e[K");
+        len += progress(g.inbuf + len);
         check(write(1, g.inbuf, len) == len);
       }
     }
@@ -256,18 +2653,20 @@ int main(int argc, char **argv) {
         len += sprintf(g.inbuf, "\r\e[K");
       }
       int rby;
-      rby = read(g.pipes[g.currentthread], g.inbuf + len, maxline - 50);
+      rby = read(head->fd, g.inbuf + len, maxline - 100);
       check(rby > 0);
+      if (head->cachefd != -1) {
+        check(write(head->cachefd, g.inbuf + len, rby) == rby);
+      }
       len += rby;
       neednewline = g.inbuf[len - 1] != '\n';
-      if (!g.quietmode && !neednewline) {
-        const char fmt[] = "\e[33m%d/%d done\e[0m";
-        len += sprintf(g.inbuf + len, fmt, g.finished, g.started);
-      }
+      if (!g.quietmode && !neednewline) len += progress(g.inbuf + len);
       check(write(1, g.inbuf, len) == len);
     } else if (waitpipe && (pfds[1].revents & POLLHUP) != 0) {
-      check(close(g.pipes[g.currentthread]) == 0);
-      g.currentthread = (g.currentthread + 1) % maxthreads;
+      check(close(head->fd) == 0);
+      head->outputdone = true;
+      finishcache(head);
+      g.currentthread = (g.currentthread + 1) % g.jobscap;
       if (!g.quietmode) {
         int len = 0;
         if (!neednewline) {
@@ -284,6 +2683,26 @@ int main(int argc, char **argv) {
     int len = sprintf(g.inbuf, "\r\e[K");
     check(write(1, g.inbuf, len) == len);
   }
-  check(feof(stdin) != 0);
-  return returncode;
+  check(g.inputdone);
+  free(pfds);
+
+  // closing the socket makes the host exit.
+  for (int i = 0; i < g.hostscount; i++) {
+    if (g.hosts[i].fd != -1) check(close(g.hosts[i].fd) == 0);
+    if (g.hosts[i].pid != 0) {
+      check(waitpid(g.hosts[i].pid, NULL, 0) == g.hosts[i].pid);
+    }
+    free(g.hosts[i].in.data);
+  }
+  free(g.hosts);
+  if (g.historyfile != NULL) savehistory();
+  if (g.report != NULL) check(fclose(g.report) == 0);
+  if (g.preload && !g.quietmode) {
+    check(clock_gettime(CLOCK_MONOTONIC, &endtime) == 0);
+    double achieved = endtime.tv_sec - starttime.tv_sec;
+    achieved += (endtime.tv_nsec - starttime.tv_nsec) * 1e-9;
+    const char fmt[] = "pararun: makespan estimated %.2fs, achieved %.2fs\n";
+    fprintf(stderr, fmt, g.estimatedmakespan, achieved);
+  }
+  return g.returncode;
 }